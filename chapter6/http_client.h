@@ -0,0 +1,179 @@
+/* http_client.h */
+
+/*
+The client side of HTTP: splitting up a URL, connecting to a server and
+sending it a request. Shared by web_get (this chapter) and the web_load load
+generator (chapter 7). Include chap06.h (or chap07.h) first.
+
+connect_to_host() and send_request() are the simple versions web_get uses,
+printing every step and exiting on errors. A program making thousands of
+connections wants neither, so each is built on a quieter piece that can be
+used on its own: resolve_host() looks the server up once, after which
+connect_to_address() connects to it as often as needed, and format_request()
+builds a request once that can then be sent any number of times.
+*/
+
+#ifndef HTTP_CLIENT_H
+#define HTTP_CLIENT_H
+
+static inline void parse_url(char* url, char** hostname, char** port,
+        char** path){
+
+    printf("URL: %s\n", url);
+
+    // URL example: http://example.com:80/res/page1.php?user=linda#account
+
+    /*
+    Start by identifying the "://" in the url, which is where the protocol
+    portion stops.
+    */
+
+    char* p;
+    p = strstr(url, "://");
+    char* protocol = 0;
+    if (p) {
+        /* If a protocol is found, protocol is set to the start of the url
+        (where the protocol starts), and p is moved to the beginning of the
+        hostname. */
+        protocol = url;
+        *p = 0;
+        p += 3;
+    } else {
+        /* If no protocol is found, p is set back to the start of the URL. */
+        p = url;
+    }
+    /* Check that the protocol is http. No other protocol is supported. */
+    if (protocol) {
+        if (strcmp(protocol, "http")) {
+            fprintf(stderr, "ERROR: Protocol %s is unsupported.\n", protocol);
+            exit(1);
+        }
+    }
+
+    /* With protocol determined, now we can save the hostname into the
+    hostname return variable. This is done by looking for the first colon,
+    slash or hash. */
+    *hostname = p;
+    while (*p && *p != ':' && *p != '/' && *p != '#') ++p;
+
+    /* After the hostname, check for a port number. */
+    *port = "80";
+    if(*p == ':') {
+        *p++ = 0;
+        *port = p;
+    }
+    while (*p && *p != ':' && *p != '/' && *p != '#') ++p;
+
+    /* After the port number, check for document path. */
+    *path = p;
+    if(*p == '/') {
+        *path = p + 1;
+    }
+    *p = 0;
+
+    /* Next, check for a hash. If one exists, overwrite it with a null
+    terminator, since the hash is not intended to be sent to the server. */
+    while (*p && *p != '#') ++p;
+    if (*p == '#') *p = 0;
+
+    /* Having parsed the hostname, port number and document path, print these
+    values out for debugging info: */
+    printf("Hostname: %s\n", *hostname);
+    printf("Port num: %s\n", *port);
+    printf("Path: %s\n", *path);
+
+}
+
+/*
+Assembles a GET request for path into buffer, including the blank line that
+terminates the header, and returns its length. keep_alive picks between
+asking the server to keep the connection open or to close it afterwards.
+*/
+static inline int format_request(char* buffer, const char* hostname,
+        const char* port, const char* path, int keep_alive) {
+    return sprintf(buffer, "GET /%s HTTP/1.1\r\n"
+        "Host: %s:%s\r\n"
+        "Connection: %s\r\n"
+        "User-Agent: honpwc web_get 1.0\r\n"
+        "\r\n", path, hostname, port, keep_alive ? "keep-alive" : "close");
+}
+
+/* This is a helper function intended to assemble the header and store it in a
+buffer, including a blank line required for terminating a header. It
+then sends this to the server. */
+static inline void send_request(SOCKET s, char* hostname, char* port,
+        char* path) {
+    char buffer[2048];
+    int length = format_request(buffer, hostname, port, path, 0);
+
+    send(s, buffer, length, 0);
+    printf("Sent Headers:\n%s", buffer); /* For debugging. */
+}
+
+/*
+Looks up hostname and port, exiting if that fails. Prints nothing else, so
+that it can be used by programs with output of their own. The result is
+freed with freeaddrinfo().
+*/
+static inline struct addrinfo* resolve_host(const char* hostname,
+        const char* port) {
+    /* Pretty much the same as the previous chapters. */
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* peer_address;
+    if(getaddrinfo(hostname, port, &hints, &peer_address)) {
+        fprintf(stderr, "ERROR: Issue with getaddrinfo(). (%d)\n", GETSOCKETERRNO());
+        exit(1);
+    }
+    return peer_address;
+}
+
+/*
+Creates a socket and connects it to peer_address. Prints nothing, and
+returns an invalid socket (with the error left in GETSOCKETERRNO()) if
+either step fails.
+*/
+static inline SOCKET connect_to_address(const struct addrinfo* peer_address) {
+    SOCKET server;
+    server = socket(peer_address->ai_family, peer_address->ai_socktype,
+        peer_address->ai_protocol);
+    if(!ISVALIDSOCKET(server)) return server;
+
+    if(connect(server, peer_address->ai_addr, peer_address->ai_addrlen)) {
+        /* Closing the socket succeeds, so it leaves the error alone. */
+        CLOSESOCKET(server);
+        return (SOCKET) -1;
+    }
+    return server;
+}
+
+static inline SOCKET connect_to_host(char* hostname, char* port) {
+    printf("Configuring remote address...\n");
+    struct addrinfo* peer_address = resolve_host(hostname, port);
+
+    printf("Remote address is...\n");
+    char address_buffer[100];
+    char service_buffer[100];
+    getnameinfo(peer_address->ai_addr, peer_address->ai_addrlen,
+        address_buffer, sizeof(address_buffer), service_buffer,
+        sizeof(service_buffer), NI_NUMERICHOST);
+    printf("%s %s\n", address_buffer, service_buffer);
+
+    printf("Creating socket...\n");
+    printf("Connecting...\n");
+    SOCKET server = connect_to_address(peer_address);
+    if(!ISVALIDSOCKET(server)) {
+        fprintf(stderr, "ERROR: Issue with connection. (%d)\n",
+            GETSOCKETERRNO());
+            exit(1);
+    }
+
+    freeaddrinfo(peer_address);
+
+    printf("Connected.\n");
+    return server;
+
+}
+
+#endif /* HTTP_CLIENT_H */
@@ -0,0 +1,340 @@
+/* http_scan.h */
+
+/*
+Fast searching for the delimiters of HTTP messages, shared by web_get (this
+chapter) and web_server (chapter 7).
+
+Finding the end of a header ("\r\n\r\n"), the end of a line ("\r\n") or the
+end of a token is what an HTTP parser spends most of its time on. Looking at
+one byte at a time, as strstr() and strchr() do, is simple but slow. Modern
+x86 processors have SIMD ("single instruction, multiple data") instructions
+that compare 16 (SSE2) or 32 (AVX2) bytes at once, so each function here
+comes in three versions ("kernels"): scalar, SSE2 and AVX2.
+
+Not every processor has AVX2, so the best kernel is chosen at run time:
+scan_init() asks the CPU which instruction sets it supports (the CPUID
+instruction, wrapped by GCC's __builtin_cpu_supports()) and points each
+function pointer at the fastest kernel available. Until scan_init() is
+called, and on processors other than x86, the scalar kernels are used.
+
+All functions search the range [p, end) and return 0 if nothing is found.
+None of them need the data to be null terminated.
+*/
+
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+SCALAR KERNELS
+*/
+
+/* Returns the first "\r\n\r\n". */
+static const char* scan_header_end_scalar(const char* p, const char* end) {
+    for (; end - p >= 4; ++p) {
+        if (p[0] == '\r' && p[1] == '\n' && p[2] == '\r' && p[3] == '\n') {
+            return p;
+        }
+    }
+    return 0;
+}
+
+/* Returns the first "\r\n". */
+static const char* scan_crlf_scalar(const char* p, const char* end) {
+    for (; end - p >= 2; ++p) {
+        if (p[0] == '\r' && p[1] == '\n') return p;
+    }
+    return 0;
+}
+
+/*
+Returns the first byte that is either stop or a control character (below
+0x20, or 0x7f). Request targets end at a space and header values at "\r",
+and control characters are not allowed inside either, so this finds the
+end of the token and any byte that would make it invalid in one pass.
+*/
+static const char* scan_token_end_scalar(const char* p, const char* end,
+        char stop) {
+    for (; p < end; ++p) {
+        unsigned char ch = *p;
+        if (ch == (unsigned char) stop || ch < 0x20 || ch == 0x7f) return p;
+    }
+    return 0;
+}
+
+/*
+Returns the first byte that isn't a token character (RFC 9110 "tchar": a
+letter, a digit or one of !#$%&'*+-.^_`|~). Methods and header names are
+tokens, so this finds the space after a method or the ':' after a header
+name, and any byte that would make either invalid, in one pass.
+*/
+static const char* scan_tchar_end_scalar(const char* p, const char* end) {
+    for (; p < end; ++p) {
+        unsigned char ch = *p;
+        if (ch >= '0' && ch <= '9') continue;
+        if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'z') continue;
+        if (!memchr("!#$%&'*+-.^_`|~", ch, 15)) return p;
+    }
+    return 0;
+}
+
+#if defined(SCAN_X86)
+
+/*
+SSE2 KERNELS
+
+_mm_cmpeq_epi8() compares 16 bytes at once, giving 0xff in each position
+that matched, and _mm_movemask_epi8() packs the top bit of each byte into an
+int, one bit per position. The lowest set bit (__builtin_ctz()) is then the
+first match. Whatever is left over at the end, too short for a full load,
+is handed to the scalar kernel.
+*/
+__attribute__((target("sse2")))
+static const char* scan_header_end_sse2(const char* p, const char* end) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+
+    /* Each load looks at 16 starting positions and 3 bytes beyond them. */
+    for (; end - p >= 16 + 3; p += 16) {
+        __m128i m = _mm_and_si128(
+            _mm_and_si128(
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) p), cr),
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 1)),
+                    lf)),
+            _mm_and_si128(
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 2)),
+                    cr),
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 3)),
+                    lf)));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return scan_header_end_scalar(p, end);
+}
+
+__attribute__((target("sse2")))
+static const char* scan_crlf_sse2(const char* p, const char* end) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+
+    for (; end - p >= 16 + 1; p += 16) {
+        __m128i m = _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) p), cr),
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 1)), lf));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return scan_crlf_scalar(p, end);
+}
+
+/*
+SSE2 only has signed byte comparisons, so "below 0x20" is tested as
+max(byte, 0x1f) == 0x1f, which treats the bytes as unsigned.
+*/
+__attribute__((target("sse2")))
+static const char* scan_token_end_sse2(const char* p, const char* end,
+        char stop) {
+    const __m128i s = _mm_set1_epi8(stop);
+    const __m128i ctl = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) p);
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, s), _mm_cmpeq_epi8(v, del)),
+            _mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return scan_token_end_scalar(p, end, stop);
+}
+
+/*
+The bytes that aren't tchars are the controls and space (up to 0x20), 0x7f
+and up, and the separators "(),/:;<=>?@[\]{}. Those come in three short
+runs and five on their own, and a byte is in the run [low, high] when
+byte - low, as an unsigned number, is at most high - low.
+*/
+__attribute__((target("sse2")))
+static inline __m128i scan_in_range_sse2(__m128i v, char low, char high) {
+    __m128i d = _mm_sub_epi8(v, _mm_set1_epi8(low));
+    return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(high - low)), d);
+}
+
+__attribute__((target("sse2")))
+static const char* scan_tchar_end_sse2(const char* p, const char* end) {
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) p);
+        __m128i m = _mm_or_si128(
+            _mm_cmpeq_epi8(_mm_max_epu8(v, space), space),
+            _mm_cmpeq_epi8(_mm_min_epu8(v, del), del));
+        m = _mm_or_si128(m, _mm_or_si128(
+            _mm_or_si128(scan_in_range_sse2(v, '(', ')'),
+                scan_in_range_sse2(v, ':', '@')),
+            scan_in_range_sse2(v, '[', ']')));
+        m = _mm_or_si128(m, _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8(','))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')),
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')),
+                    _mm_cmpeq_epi8(v, _mm_set1_epi8('}'))))));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return scan_tchar_end_scalar(p, end);
+}
+
+/*
+AVX2 KERNELS
+
+The same again, 32 bytes at a time. What is left over is handed to the SSE2
+kernel, but only after _mm256_zeroupper(): SSE2 code run while the upper
+halves of the 256-bit registers are still in use is many times slower on
+Intel processors, and GCC doesn't clear them itself before jumping to a
+function compiled for SSE2 only.
+*/
+__attribute__((target("avx2")))
+static const char* scan_header_end_avx2(const char* p, const char* end) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+
+    for (; end - p >= 32 + 3; p += 32) {
+        __m256i m = _mm256_and_si256(
+            _mm256_and_si256(
+                _mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i*) p), cr),
+                _mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i*) (p + 1)), lf)),
+            _mm256_and_si256(
+                _mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i*) (p + 2)), cr),
+                _mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i*) (p + 3)), lf)));
+        unsigned mask = _mm256_movemask_epi8(m);
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    _mm256_zeroupper();
+    return scan_header_end_sse2(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* scan_crlf_avx2(const char* p, const char* end) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+
+    for (; end - p >= 32 + 1; p += 32) {
+        __m256i m = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) p), cr),
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i*) (p + 1)), lf));
+        unsigned mask = _mm256_movemask_epi8(m);
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    _mm256_zeroupper();
+    return scan_crlf_sse2(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* scan_token_end_avx2(const char* p, const char* end,
+        char stop) {
+    const __m256i s = _mm256_set1_epi8(stop);
+    const __m256i ctl = _mm256_set1_epi8(0x1f);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) p);
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, s),
+                _mm256_cmpeq_epi8(v, del)),
+            _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctl), ctl));
+        unsigned mask = _mm256_movemask_epi8(m);
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    _mm256_zeroupper();
+    return scan_token_end_sse2(p, end, stop);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i scan_in_range_avx2(__m256i v, char low, char high) {
+    __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8(low));
+    return _mm256_cmpeq_epi8(
+        _mm256_min_epu8(d, _mm256_set1_epi8(high - low)), d);
+}
+
+__attribute__((target("avx2")))
+static const char* scan_tchar_end_avx2(const char* p, const char* end) {
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) p);
+        __m256i m = _mm256_or_si256(
+            _mm256_cmpeq_epi8(_mm256_max_epu8(v, space), space),
+            _mm256_cmpeq_epi8(_mm256_min_epu8(v, del), del));
+        m = _mm256_or_si256(m, _mm256_or_si256(
+            _mm256_or_si256(scan_in_range_avx2(v, '(', ')'),
+                scan_in_range_avx2(v, ':', '@')),
+            scan_in_range_avx2(v, '[', ']')));
+        m = _mm256_or_si256(m, _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('{')),
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('}'))))));
+        unsigned mask = _mm256_movemask_epi8(m);
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    _mm256_zeroupper();
+    return scan_tchar_end_sse2(p, end);
+}
+
+#endif /* SCAN_X86 */
+
+/*
+DISPATCH
+
+The functions the programs call. They start out as the scalar kernels and
+are switched over by scan_init(), which should be called once at start up,
+before any threads are created.
+*/
+static const char* (*scan_header_end)(const char*, const char*) =
+    scan_header_end_scalar;
+static const char* (*scan_crlf)(const char*, const char*) =
+    scan_crlf_scalar;
+static const char* (*scan_token_end)(const char*, const char*, char) =
+    scan_token_end_scalar;
+static const char* (*scan_tchar_end)(const char*, const char*) =
+    scan_tchar_end_scalar;
+
+/* Returns the name of the kernels in use, for printing. */
+static const char* scan_init() {
+#if defined(SCAN_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_header_end = scan_header_end_avx2;
+        scan_crlf = scan_crlf_avx2;
+        scan_token_end = scan_token_end_avx2;
+        scan_tchar_end = scan_tchar_end_avx2;
+        return "avx2";
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        scan_header_end = scan_header_end_sse2;
+        scan_crlf = scan_crlf_sse2;
+        scan_token_end = scan_token_end_sse2;
+        scan_tchar_end = scan_tchar_end_sse2;
+        return "sse2";
+    }
+#endif
+    return "scalar";
+}
+
+#endif /* HTTP_SCAN_H */
@@ -1,134 +1,9 @@
 #include "chap06.h"
+#include "http_scan.h"
+#include "http_client.h"
 
 #define TIMEOUT 5.0
 
-void parse_url(char* url, char** hostname, char** port, char** path){
-
-    printf("URL: %s\n", url);
-
-    // URL example: http://example.com:80/res/page1.php?user=linda#account
-
-    /*
-    Start by identifying the "://" in the url, which is where the protocol
-    portion stops.
-    */
-
-    char* p;
-    p = strstr(url, "://");
-    char* protocol = 0;
-    if (p) {
-        /* If a protocol is found, protocol is set to the start of the url 
-        (where the protocol starts), and p is moved to the beginning of the 
-        hostname. */
-        protocol = url;
-        *p = 0;
-        p += 3;   
-    } else {
-        /* If no protocol is found, p is set back to the start of the URL. */
-        p = url;
-    }
-    /* Check that the protocol is http. No other protocol is supported. */
-    if (protocol) {
-        if (strcmp(protocol, "http")) {
-            fprintf(stderr, "ERROR: Protocol %s is unsupported.\n", protocol);
-            exit(1);
-        }
-    }
-
-    /* With protocol determined, now we can save the hostname into the 
-    hostname return variable. This is done by looking for the first colon, 
-    slash or hash. */
-    *hostname = p;
-    while (*p && *p != ':' && *p != '/' && *p != '#') ++p;
-
-    /* After the hostname, check for a port number. */
-    *port = "80";
-    if(*p == ';') {
-        *p++ = 0;
-        *port = p;
-    }
-    while (*p && *p != ':' && *p != '/' && *p != '#') ++p;
-
-    /* After the port number, check for document path. */
-    *path = p;
-    if(*p == '/') {
-        *path = p + 1;
-    }
-    *p = 0;
-
-    /* Next, check for a hash. If one exists, overwrite it with a null 
-    terminator, since the hash is not intended to be sent to the server. */
-    while (*p && *p != '#') ++p;
-    if (*p == '#') *p = 0;
-
-    /* Having parsed the hostname, port number and document path, print these 
-    values out for debugging info: */
-    printf("Hostname: %s\n", *hostname);
-    printf("Port num: %s\n", *port);
-    printf("Path: %s\n", *path);
-
-}
-
-/* This is a helper function intended to assemble the header and store it in a 
-buffer, including a blank line required for terminating a header. It 
-then sends this to the server. */
-void send_request(SOCKET s, char* hostname, char* port, char* path) {
-    char buffer[2048];
-
-    sprintf(buffer, "GET /%s HTTP/1.1\r\n", path);
-    sprintf(buffer + strlen(buffer), "Host: %s:%s\r\n", hostname, port);
-    sprintf(buffer + strlen(buffer), "Connection: close\r\n");
-    sprintf(buffer + strlen(buffer), "User-Agent: honpwc web_get 1.0\r\n");
-    sprintf(buffer + strlen(buffer), "\r\n");
-
-    send(s, buffer, strlen(buffer), 0);
-    printf("Sent Headers:\n%s", buffer); /* For debugging. */
-}
-
-SOCKET connect_to_host(char* hostname, char* port) {
-    /* Pretty much the same as the previous chapters. */
-    printf("Configuring remote address...\n");
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_socktype = SOCK_STREAM;
-    struct addrinfo* peer_address;
-    if(getaddrinfo(hostname, port, &hints, &peer_address)) {
-        fprintf(stderr, "ERROR: Issue with getaddrinfo(). (%d)\n", GETSOCKETERRNO());
-        exit(1);
-    }
-
-    printf("Remote address is...\n");
-    char address_buffer[100];
-    char service_buffer[100];
-    getnameinfo(peer_address->ai_addr, peer_address->ai_addrlen, 
-        address_buffer, sizeof(address_buffer), service_buffer, 
-        sizeof(service_buffer), NI_NUMERICHOST);
-    printf("%s %s", address_buffer, service_buffer);
-
-    printf("Creating socket...\n");
-    SOCKET server;
-    server = socket(peer_address->ai_family, peer_address->ai_socktype, 
-        peer_address->ai_protocol);
-    if(!ISVALIDSOCKET(server)) {
-        fprintf(stderr, "ERROR: Issue with socket creation. (%d)\n", 
-            GETSOCKETERRNO());
-            exit(1);
-    }
-
-    printf("Connecting...\n");
-    if(connect(server, peer_address->ai_addr, peer_address->ai_addrlen)) {
-        fprintf(stderr, "ERROR: Issue with connection. (%d)\n", 
-            GETSOCKETERRNO());
-            exit(1);
-    }
-
-    freeaddrinfo(peer_address);
-
-    printf("Connected.\n");
-    return server;
-
-}
-
 int main(int argc, char* argv[]){
 
     /* Windows stuff. */
@@ -145,6 +20,9 @@ int main(int argc, char* argv[]){
         return 1;
     }
 
+    /* Pick the fastest delimiter scanning kernels this CPU supports. */
+    scan_init();
+
     char* url = argv[1];
     char *hostname, *port, *path;
     parse_url(url, &hostname, &port, &path);
@@ -163,6 +41,9 @@ int main(int argc, char* argv[]){
                         in determining the length of the response body.
         -   end:        A pointer to the end of response.
         -   body:       A pointer to the start of the response body.
+        -   header_scan:    Where the search for the end of the header 
+                            resumes, so that bytes already searched are not 
+                            searched again after every recv().
     
     Recall that the lenth of the HTTP response body is not always given, so 
     we accomodate for that by using multiple methods to determine if.
@@ -173,6 +54,7 @@ int main(int argc, char* argv[]){
     char *p = response, *q; 
     char *end = response + RESPONSE_SIZE;
     char* body = 0;
+    char* header_scan = response;
 
     enum {length, chunked, connection};
     int encoding = 0;
@@ -238,9 +120,12 @@ int main(int argc, char* argv[]){
             /*
             If the HTTP body hasn't been found yet, find it here. Note the 
             formatting of this line--it will only enter this if statement if 
-            body has not been found already but is then found with strstr().
+            body has not been found already but is then found with 
+            scan_header_end() (see http_scan.h). If it isn't found, the next 
+            search starts from the last three bytes received, since they 
+            could be the start of a "\r\n\r\n" that is still arriving.
             */
-            if (!body && (body = strstr(response, "\r\n\r\n"))) {
+            if (!body && (body = (char*) scan_header_end(header_scan, p))) {
                 /* Body pointer is updated to the beginning of the body. */
                 *body = 0;
                 body += 4;
@@ -278,6 +163,8 @@ int main(int argc, char* argv[]){
                     }
                 }
                 printf("\nReceived body.\n");
+            } else if (!body) {
+                header_scan = p - response > 3 ? p - 3 : response;
             }
             /* 
             If the body has been found and the encoding == length, then 
@@ -295,7 +182,7 @@ int main(int argc, char* argv[]){
                 The receiving logic is a little more complicated when the 
                 encoding type is chunked. When remaining == 0, this indicates 
                 that the program is waiting to receive a new chunk length. 
-                Since each chunk length ends with a newline (strstr() is 
+                Since each chunk length ends with a newline (scan_crlf() is 
                 used to check for one), if a newline is found, that indicates 
                 that an entire chunk length has been received. That chunk 
                 length is then read using strtol(), and remaining is set to 
@@ -311,10 +198,13 @@ int main(int argc, char* argv[]){
                 } else if (encoding == chunked) {
                     do {
                         if (remaining == 0) {
-                            if ((q = strstr(body, "\r\n"))) {
+                            if ((q = (char*) scan_crlf(body, p))) {
                                 remaining = strtol(body, 0, 16);
                                 if (!remaining) goto finish;
                                 body = q + 2;
+                            } else {
+                                /* The chunk length hasn't fully arrived. */
+                                break;
                             }
                         } if (remaining && p - body >= remaining) {
                             printf("%.*s", remaining, body);
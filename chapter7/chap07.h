@@ -10,10 +10,27 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/resource.h>
 
 #endif
 
@@ -33,4 +50,5 @@
 
 #include <stdio.h>
 #include <string.h>
-#include <stdlib.h>
\ No newline at end of file
+#include <stdlib.h>
+#include <time.h>
\ No newline at end of file
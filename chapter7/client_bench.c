@@ -0,0 +1,141 @@
+/* client_bench.c */
+
+/*
+CHAPTER 7:  A microbenchmark for web_server's client table
+
+To execute: gcc -O2 client_bench.c -o client_bench -pthread -lz
+            ./client_bench [ROUNDS]
+
+Builds web_server.c without its main() and calls get_client() and
+drop_client() directly, the way the accept and close paths do. For 100,
+1000, 10000 and 100000 live clients it gives each of that many sockets a
+client, and then times ROUNDS (default 200000) rounds of churn. Each round:
+
+    accept      creates a client for one more socket with get_client()
+    lookup      finds a randomly chosen live client with get_client(), as
+                an event for its socket would
+    close       drops the new client again with drop_client()
+
+100000 real sockets would need a descriptor limit few systems allow without
+root, so the clients are given socket numbers from the limit up, which no
+real descriptor can have. That makes no difference to the table, which is
+indexed by socket number all the same. drop_client()'s close() of such a
+number fails at once (EBADF), but is still a system call that has nothing
+to do with the table, so it is timed on its own as well, and the "table"
+column is the three together with that taken away.
+
+Since clients are found through an array indexed by socket and unlinked
+from their neighbours directly, none of the columns should grow with the
+number of clients, other than by the cache misses of a bigger table. (The
+original linked list made every close walk the list, so a close among
+100000 clients cost 1000 times one among 100.)
+*/
+
+#define WEB_SERVER_NO_MAIN
+#include "web_server.c"
+
+#include <sys/resource.h>
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+Returns the nanoseconds per close() of socket, which isn't open, timed the
+same way as the rounds are.
+*/
+double time_close(SOCKET socket, int rounds) {
+    uint64_t total = 0;
+    int i;
+    for (i = 0; i < rounds; ++i) {
+        uint64_t start = now_ns();
+        close(socket);
+        total += now_ns() - start;
+    }
+    return (double) total / rounds;
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 200000;
+    if (argc > 2 || rounds < 1) {
+        fprintf(stderr, "Usage: ./client_bench [ROUNDS]\n");
+        return 1;
+    }
+
+    int sizes[] = { 100, 1000, 10000, 100000 };
+    int size_count = sizeof(sizes) / sizeof(*sizes);
+
+    /* Descriptors are always below the limit, so numbers from it are free. */
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > (1 << 24)) {
+        fprintf(stderr, "ERROR: The descriptor limit is too high to use.\n");
+        return 1;
+    }
+    SOCKET first = limit.rlim_cur;
+
+    /* web_server's main() would do these. */
+    scan_init();
+    (void) access_log_path;
+
+    /* get_client() and drop_client() keep their counts in a worker. */
+    static struct worker worker;
+    self = &worker;
+
+    printf("%-10s%12s%12s%12s%12s%12s\n", "clients", "accept", "lookup",
+        "close", "close()", "table");
+
+    int s;
+    for (s = 0; s < size_count; ++s) {
+        int count = sizes[s];
+        pool_init(count + 1);
+
+        int i;
+        for (i = 0; i < count; ++i) {
+            if (!get_client(first + i)) {
+                fprintf(stderr, "ERROR: Can't create client %d.\n", i);
+                return 1;
+            }
+        }
+
+        uint64_t accept_ns = 0, lookup_ns = 0, close_ns = 0;
+        unsigned seed = 12345;
+        for (i = 0; i < rounds; ++i) {
+            seed = seed * 1103515245 + 12345;
+            SOCKET other = first + (seed >> 8) % count;
+
+            uint64_t t0 = now_ns();
+            struct client_info* client = get_client(first + count);
+            uint64_t t1 = now_ns();
+            struct client_info* found = get_client(other);
+            uint64_t t2 = now_ns();
+            drop_client(client);
+            uint64_t t3 = now_ns();
+
+            if (!client || found->socket != other) {
+                fprintf(stderr, "ERROR: Lookup failed.\n");
+                return 1;
+            }
+            accept_ns += t1 - t0;
+            lookup_ns += t2 - t1;
+            close_ns += t3 - t2;
+        }
+
+        double fd_only = time_close(first + count, rounds);
+        double accept = (double) accept_ns / rounds;
+        double lookup = (double) lookup_ns / rounds;
+        double closing = (double) close_ns / rounds;
+        printf("%-10d%9.1f ns%9.1f ns%9.1f ns%9.1f ns%9.1f ns\n", count,
+            accept, lookup, closing, fd_only,
+            accept + lookup + closing - fd_only);
+        fflush(stdout);
+
+        /* Drop everyone and start over. */
+        while (clients) drop_client(clients);
+        free(pool.slots);
+    }
+
+    return 0;
+}
@@ -0,0 +1,227 @@
+/* file_bench.c */
+
+/*
+CHAPTER 7:  A benchmark for the ways of sending a file body
+
+To execute: gcc -O2 file_bench.c -o file_bench -pthread
+            ./file_bench [-r ROUNDS] [FILE]
+
+Sends FILE (by default a 256 MB file of random bytes, made in /tmp for the
+run and deleted afterwards) ROUNDS times (default 4) over a TCP connection
+on 127.0.0.1, once with each of the ways web_server has had of sending a
+file body:
+
+    fread/send  the original loop: fread() 1024 bytes into a buffer on the
+                stack, send() them, and again, so every byte is copied
+                twice and every kilobyte costs two system calls
+    sendfile    sendfile() from the file straight to the socket, as many
+                bytes at a time as the socket takes, with no copy through
+                the program at all
+    splice      splice() from the file into a pipe and from the pipe to the
+                socket, web_server's fallback for where sendfile() isn't
+                supported
+
+A second thread reads the connection as fast as it can and throws the bytes
+away, standing in for the client. For each way the program prints the
+throughput in MB/s and the CPU time the sending thread used per gigabyte
+sent, which is what the server itself pays; the client's side is the same
+whichever way is used. The file is read once first so that it is in the
+page cache for every run, and the disk doesn't come into it.
+
+On a machine with a single CPU the sender and the reader take turns, so
+the throughput is bounded by the reader too; the CPU per GB is not.
+*/
+
+#define _GNU_SOURCE
+#include "chap07.h"
+#include <stdint.h>
+
+#define READ_CHUNK (64 * 1024)
+
+static off_t file_size;
+static long rounds = 4;
+
+uint64_t now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void fail(const char* what) {
+    fprintf(stderr, "ERROR: %s failed. (%d)\n", what, errno);
+    exit(1);
+}
+
+/* The client: reads and discards everything until the sender hangs up. */
+void* drain(void* arg) {
+    SOCKET s = *(SOCKET*) arg;
+    static char buffer[READ_CHUNK];
+    uint64_t total = 0;
+    ssize_t r;
+    while ((r = recv(s, buffer, sizeof(buffer), 0)) > 0) total += r;
+    return (void*) (uintptr_t) total;
+}
+
+/* The original loop from serve_resource(). */
+void send_fread(SOCKET s, const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) fail("fopen()");
+    char buffer[1024];
+    size_t r = fread(buffer, 1, 1024, fp);
+    while (r) {
+        if (send(s, buffer, r, 0) < 0) fail("send()");
+        r = fread(buffer, 1, 1024, fp);
+    }
+    fclose(fp);
+}
+
+/* sendfile(), resuming after partial sends. */
+void send_sendfile(SOCKET s, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) fail("open()");
+    off_t offset = 0;
+    while (offset < file_size) {
+        ssize_t sent = sendfile(s, fd, &offset, file_size - offset);
+        if (sent < 0 && errno != EINTR) fail("sendfile()");
+    }
+    close(fd);
+}
+
+/* splice() through a pipe, as web_server falls back to. */
+void send_splice(SOCKET s, const char* path) {
+    int fd = open(path, O_RDONLY);
+    int pipes[2];
+    if (fd < 0) fail("open()");
+    if (pipe(pipes)) fail("pipe()");
+    loff_t offset = 0;
+    while (offset < file_size) {
+        ssize_t in = splice(fd, &offset, pipes[1], 0, file_size - offset,
+            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in <= 0) fail("splice()");
+        while (in > 0) {
+            ssize_t out = splice(pipes[0], 0, s, 0, in,
+                SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out <= 0) fail("splice()");
+            in -= out;
+        }
+    }
+    close(pipes[0]);
+    close(pipes[1]);
+    close(fd);
+}
+
+/* Makes a connected pair of TCP sockets on 127.0.0.1. */
+void connect_pair(SOCKET* sender, SOCKET* receiver) {
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (!ISVALIDSOCKET(listener) ||
+        bind(listener, (struct sockaddr*) &address, sizeof(address)) ||
+        listen(listener, 1) ||
+        getsockname(listener, (struct sockaddr*) &address, &length)) {
+        fail("Setting up the listener");
+    }
+    *receiver = socket(AF_INET, SOCK_STREAM, 0);
+    if (!ISVALIDSOCKET(*receiver) ||
+        connect(*receiver, (struct sockaddr*) &address, sizeof(address))) {
+        fail("connect()");
+    }
+    *sender = accept(listener, 0, 0);
+    if (!ISVALIDSOCKET(*sender)) fail("accept()");
+    CLOSESOCKET(listener);
+}
+
+void run(const char* name, void (*method)(SOCKET, const char*),
+        const char* path) {
+    SOCKET sender, receiver;
+    connect_pair(&sender, &receiver);
+    pthread_t reader;
+    if (pthread_create(&reader, 0, drain, &receiver)) fail("pthread_create()");
+
+    uint64_t wall = now_ns(CLOCK_MONOTONIC);
+    uint64_t cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+    long i;
+    for (i = 0; i < rounds; ++i) method(sender, path);
+    cpu = now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    shutdown(sender, SHUT_WR);
+
+    void* received;
+    pthread_join(reader, &received);
+    wall = now_ns(CLOCK_MONOTONIC) - wall;
+    CLOSESOCKET(sender);
+    CLOSESOCKET(receiver);
+
+    double bytes = (double) file_size * rounds;
+    if ((uintptr_t) received != (uintptr_t) bytes) {
+        fprintf(stderr, "ERROR: %s delivered %lu of %.0f bytes.\n", name,
+            (unsigned long) (uintptr_t) received, bytes);
+        exit(1);
+    }
+    printf("%-12s%10.0f MB/s%10.3f s CPU per GB\n", name,
+        bytes / (1 << 20) / (wall / 1e9),
+        cpu / 1e9 / (bytes / (1 << 30)));
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    const char* path = 0;
+    int a;
+    for (a = 1; a < argc; ++a) {
+        if (strcmp(argv[a], "-r") == 0 && a + 1 < argc) {
+            rounds = atol(argv[++a]);
+        } else if (argv[a][0] != '-' && !path) {
+            path = argv[a];
+        } else {
+            rounds = 0;
+            break;
+        }
+    }
+    if (rounds < 1) {
+        fprintf(stderr, "Usage: ./file_bench [-r ROUNDS] [FILE]\n");
+        return 1;
+    }
+
+    /* Without a file, make one of random bytes, which won't compress. */
+    char made[] = "/tmp/file_bench_XXXXXX";
+    if (!path) {
+        int fd = mkstemp(made);
+        if (fd < 0) fail("mkstemp()");
+        static char block[1 << 20];
+        int i;
+        for (i = 0; i < 256; ++i) {
+            if (getrandom(block, sizeof(block), 0) != sizeof(block) ||
+                write(fd, block, sizeof(block)) != sizeof(block)) {
+                fail("Writing the test file");
+            }
+        }
+        close(fd);
+        path = made;
+    }
+
+    struct stat st;
+    if (stat(path, &st) || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        fprintf(stderr, "ERROR: %s isn't a file with anything in it.\n", path);
+        return 1;
+    }
+    file_size = st.st_size;
+
+    /* Read it once so that every run finds it in the page cache. */
+    FILE* fp = fopen(path, "rb");
+    static char warm[READ_CHUNK];
+    if (fp) {
+        while (fread(warm, 1, sizeof(warm), fp) > 0) {}
+        fclose(fp);
+    }
+
+    printf("Sending %s (%.1f MB) %ld times over 127.0.0.1.\n\n", path,
+        file_size / 1048576.0, rounds);
+    run("fread/send", send_fread, path);
+    run("sendfile", send_sendfile, path);
+    run("splice", send_splice, path);
+
+    if (path == made) unlink(made);
+    return 0;
+}
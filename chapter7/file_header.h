@@ -0,0 +1,92 @@
+/* file_header.h */
+
+/*
+What the server says about a file in a response: its Content-Type, whether 
+it is worth compressing, and the header lines that go with its body. Shared 
+by web_server and web_pack, which works the header lines out ahead of time 
+for the files it packs. Include chap07.h first.
+*/
+
+#ifndef FILE_HEADER_H
+#define FILE_HEADER_H
+
+static inline const char *get_content_type(const char* path) {
+    const char *last_dot = strrchr(path, '.');
+    if (last_dot) {
+        if (strcmp(last_dot, ".css") == 0) return "text/css";
+        if (strcmp(last_dot, ".csv") == 0) return "text/csv";
+        if (strcmp(last_dot, ".gif") == 0) return "image/gif";
+        if (strcmp(last_dot, ".htm") == 0) return "text/html";
+        if (strcmp(last_dot, ".html") == 0) return "text/html";
+        if (strcmp(last_dot, ".ico") == 0) return "image/x-icon";
+        if (strcmp(last_dot, ".jpeg") == 0) return "image/jpeg";
+        if (strcmp(last_dot, ".jpg") == 0) return "image/jpeg";
+        if (strcmp(last_dot, ".js") == 0) return "application/javascript";
+        if (strcmp(last_dot, ".json") == 0) return "application/json";
+        if (strcmp(last_dot, ".png") == 0) return "image/png";
+        if (strcmp(last_dot, ".pdf") == 0) return "application/pdf";
+        if (strcmp(last_dot, ".svg") == 0) return "image/svg+xml";
+        if (strcmp(last_dot, ".txt") == 0) return "text/plain";
+    }
+
+    return "application/octet-stream";
+}
+
+/*
+Whether files of a content type are worth compressing (see COMPRESSION in 
+web_server.c). Text shrinks to a fraction of its size; images and PDFs are 
+compressed already.
+*/
+static inline int is_compressible(const char* content_type) {
+    return strncmp(content_type, "text/", 5) == 0 || 
+        strcmp(content_type, "application/javascript") == 0 || 
+        strcmp(content_type, "application/json") == 0 || 
+        strcmp(content_type, "image/svg+xml") == 0;
+}
+
+/*
+The Vary header for responses with a file of this content type. Responses 
+for compressible files depend on the request's Accept-Encoding, and caches 
+between us and the client need to be told so.
+*/
+static inline const char* vary_header(const char* content_type) {
+    return is_compressible(content_type) ? "Vary: Accept-Encoding\r\n" : "";
+}
+
+/*
+Formats a file's entity tag (see CONDITIONAL REQUESTS in web_server.c). It 
+is made from the inode, size and mtime, so it changes whenever the file is 
+replaced or modified, and costs nothing to compute.
+*/
+static inline void format_etag(char* etag, ino_t inode, size_t size, 
+        time_t mtime) {
+    sprintf(etag, "\"%lx-%lx-%lx\"", (unsigned long) inode, 
+        (unsigned long) size, (unsigned long) mtime);
+}
+
+/*
+Formats the header lines sent with every response carrying a file's body, 
+including its validators. encoding names the compression of a compressed 
+variant, or is null for the file itself; only the file itself is offered in 
+ranges. web_server does this once, when a file is opened or cached, and 
+web_pack when it packs the file.
+*/
+static inline int format_file_header(char* header, const char* etag, 
+        const char* content_type, const char* encoding, size_t size, 
+        time_t mtime) {
+    char date[64];
+    struct tm tm;
+    gmtime_r(&mtime, &tm);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    char* p = header;
+    p += sprintf(p, "Content-Length: %lu\r\nContent-Type: %s\r\n", 
+        (unsigned long) size, content_type);
+    if (encoding) p += sprintf(p, "Content-Encoding: %s\r\n", encoding);
+    else p += sprintf(p, "Accept-Ranges: bytes\r\n");
+    p += sprintf(p, "%sETag: %s\r\nLast-Modified: %s\r\n", 
+        vary_header(content_type), etag, date);
+    return p - header;
+}
+
+#endif /* FILE_HEADER_H */
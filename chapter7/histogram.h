@@ -0,0 +1,81 @@
+/* histogram.h */
+
+/*
+Latency histograms in the style of HdrHistogram, shared by web_server (which 
+reports them at /__stats) and web_load (which measures the server with 
+them).
+
+Values from 0 to 31 each get a bucket of their own, and above that every 
+power of two is split into 32 buckets. Every value is then counted with an 
+error of at most 1/32 (about 3%), and the whole range up to 2^40 (about 12 
+days, in microseconds) takes a fixed 1152 buckets. Recording a value is a 
+couple of shifts and an increment, cheap enough to do for every request. 
+Histograms kept by separate threads are combined with hist_merge().
+*/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+static int hist_index(uint64_t value) {
+    if (value < HIST_SUB) return (int) value;
+    if (value >> HIST_MAX_BITS) value = (1ull << HIST_MAX_BITS) - 1;
+    /* The position of the top bit picks the power of two, and the 
+    HIST_SUB_BITS bits below it the bucket within that power. */
+    int top = 63 - __builtin_clzll(value);
+    int shift = top - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int) (value >> shift) - HIST_SUB;
+}
+
+/* The largest value that is counted in bucket i. */
+static uint64_t hist_bucket_max(int i) {
+    if (i < HIST_SUB) return i;
+    int shift = i / HIST_SUB - 1;
+    uint64_t first = (uint64_t) (i % HIST_SUB + HIST_SUB) << shift;
+    return first + (1ull << shift) - 1;
+}
+
+static void hist_record(struct histogram* h, uint64_t value) {
+    ++h->counts[hist_index(value)];
+    ++h->count;
+    h->sum += value;
+    if (value > h->max) h->max = value;
+}
+
+/* The value below which fraction (0 to 1) of the recorded values fall. */
+static uint64_t hist_percentile(const struct histogram* h, double fraction) {
+    if (!h->count) return 0;
+    unsigned long want = (unsigned long) (fraction * h->count + 0.5);
+    if (want < 1) want = 1;
+    unsigned long seen = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->counts[i];
+        if (seen >= want) break;
+    }
+    uint64_t value = hist_bucket_max(i);
+    return value < h->max ? value : h->max;
+}
+
+static void hist_merge(struct histogram* into, const struct histogram* h) {
+    int i;
+    for (i = 0; i < HIST_BUCKETS; ++i) into->counts[i] += h->counts[i];
+    into->count += h->count;
+    into->sum += h->sum;
+    if (h->max > into->max) into->max = h->max;
+}
+
+#endif /* HISTOGRAM_H */
@@ -0,0 +1,75 @@
+/* pack.h */
+
+/*
+The format of the archives that web_pack builds from public/ and that
+web_server serves with --pack. Everything the server needs to answer a
+request for a file is worked out when the archive is built, so serving one
+takes no system calls beyond the send itself:
+
+    struct pack_header
+    struct pack_entry       count of them, sorted by path
+    string table            NUL-terminated strings, referred to by offset
+    bodies                  each starting on a PACK_ALIGN boundary
+
+An entry gives the file's path as requested ("/index.html"), its
+Content-Type, its ETag and ready-made header lines, and where its body lies
+in the archive. Compressible files may have a second, gzip-compressed body
+with its own ETag and header lines. A string offset of 0 means "none",
+since the string table starts with an empty string.
+
+Numbers are stored in the byte order of the machine that built the
+archive, which is meant to be built as part of deploying to that machine.
+*/
+
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+
+#define PACK_MAGIC "WEBPACK1"
+#define PACK_ALIGN 64
+
+struct pack_header {
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+    /* Where the string table starts, and how long it is. */
+    uint64_t strings;
+    uint64_t strings_length;
+};
+
+struct pack_entry {
+    /* String table offsets. */
+    uint32_t path;
+    uint32_t content_type;
+    uint32_t etag;
+    uint32_t header;
+    uint32_t gzip_etag;
+    uint32_t gzip_header;
+    int64_t mtime;
+    /* Archive offsets and lengths of the bodies. */
+    uint64_t body;
+    uint64_t body_length;
+    uint64_t gzip_body;
+    uint64_t gzip_length;
+};
+
+/*
+Finds path among the count entries (sorted by path, with strcmp()), whose
+strings are in strings. Returns the entry's index, or -1. A binary search
+needs at most about 20 comparisons even for a million files.
+*/
+static inline int pack_find(const struct pack_entry* entries, uint32_t count,
+        const char* strings, const char* path) {
+    uint32_t low = 0, high = count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        int c = strcmp(strings + entries[middle].path, path);
+        if (c == 0) return middle;
+        if (c < 0) low = middle + 1;
+        else high = middle;
+    }
+    return -1;
+}
+
+#endif /* PACK_H */
@@ -0,0 +1,167 @@
+/* parse_bench.c */
+
+/*
+CHAPTER 7:  A microbenchmark for the request parser
+
+To execute: gcc -O2 parse_bench.c -o parse_bench
+            ./parse_bench [MILLISECONDS]
+
+Feeds requests to parse_request() (see request_parser.h) the way web_server
+does, and prints how many megabytes of requests per second it gets through:
+
+    whole       the request arrives in one recv(), one call
+    16 B        it arrives 16 bytes at a time, one call after each piece
+    1 B         it arrives a byte at a time, as from a very slow client
+    rescan      a byte at a time again, but looked at the way web_server
+                used to: after every piece the whole buffer so far is
+                searched again with strstr() for the "\r\n\r\n"
+
+The parser remembers how far it got, so it looks at each byte once however
+the request is split up, and the first three columns only differ by the
+cost of the calls themselves. The rescan looks at the first byte once per
+piece, so its work grows with the square of the request's length; that is
+the difference the rows, from a short request to one carrying 16 KB of
+cookies, are there to show. Each measurement runs for MILLISECONDS
+(default 300).
+*/
+
+#include "chap07.h"
+#include "request_parser.h"
+
+#define MAX_BENCH_REQUEST (32 * 1024)
+
+static const char* request_head =
+    "GET /static/css/site.min.css?v=3f9a2c1 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) "
+        "Gecko/20100101 Firefox/125.0\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Language: en-CA,en-US;q=0.7,en;q=0.3\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://www.example.com/\r\n"
+    "Connection: keep-alive\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "If-None-Match: \"65f2a1c3-9e41\"\r\n";
+
+enum { MODE_WHOLE, MODE_16, MODE_1, MODE_RESCAN, MODES };
+static const char* mode_names[MODES] = { "whole", "16 B", "1 B", "rescan" };
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+Builds the request in out: the header lines above, then a Cookie header
+with cookie_bytes of cookies, then the blank line. Returns its length.
+*/
+int build_request(char* out, int cookie_bytes) {
+    int length = sprintf(out, "%s", request_head);
+    if (cookie_bytes) {
+        length += sprintf(out + length, "Cookie: ");
+        int i = 0;
+        while (cookie_bytes > 0) {
+            int n = sprintf(out + length, "c%d=%08x%08x; ", i, i * 2654435761u,
+                i * 40503u);
+            length += n;
+            cookie_bytes -= n;
+            ++i;
+        }
+        length += sprintf(out + length, "\r\n");
+    }
+    length += sprintf(out + length, "\r\n");
+    return length;
+}
+
+/*
+Parses the request once, as it would arrive in the given mode, with the
+bytes received so far in buffer. Returns 1 if the end was found in the
+right place.
+*/
+int parse_once(int mode, const char* request, int length, char* buffer) {
+    struct http_request req;
+    parser_reset(&req);
+
+    if (mode == MODE_WHOLE) {
+        memcpy(buffer, request, length);
+        return parse_request(&req, buffer, length) == 1 &&
+            req.length == length;
+    }
+
+    int piece = mode == MODE_16 ? 16 : 1;
+    int received = 0;
+    while (received < length) {
+        int n = length - received < piece ? length - received : piece;
+        memcpy(buffer + received, request + received, n);
+        received += n;
+
+        if (mode == MODE_RESCAN) {
+            buffer[received] = 0;
+            const char* end = strstr(buffer, "\r\n\r\n");
+            if (end) return end + 4 - buffer == length;
+            continue;
+        }
+
+        int parsed = parse_request(&req, buffer, received);
+        if (parsed < 0) return 0;
+        if (parsed) return req.length == length;
+    }
+    return 0;
+}
+
+/* Returns megabytes (10^6 bytes) per second, or -1 if a parse went wrong. */
+double measure(int mode, const char* request, int length, char* buffer,
+        uint64_t duration) {
+    uint64_t start = now_ns(), elapsed;
+    uint64_t parsed = 0;
+    do {
+        int i;
+        for (i = 0; i < 16; ++i) {
+            if (!parse_once(mode, request, length, buffer)) return -1;
+            parsed += length;
+        }
+        elapsed = now_ns() - start;
+    } while (elapsed < duration);
+    return parsed * 1000.0 / elapsed;
+}
+
+int main(int argc, char* argv[]) {
+    long milliseconds = argc > 1 ? atol(argv[1]) : 300;
+    if (argc > 2 || milliseconds < 1) {
+        fprintf(stderr, "Usage: ./parse_bench [MILLISECONDS]\n");
+        return 1;
+    }
+    printf("Scanning kernels: %s\n\n", scan_init());
+
+    static char request[MAX_BENCH_REQUEST];
+    static char buffer[MAX_BENCH_REQUEST + 1];
+    int cookies[] = { 0, 1024, 4096, 16384 };
+
+    printf("%-16s", "request");
+    int m;
+    for (m = 0; m < MODES; ++m) printf("%14s", mode_names[m]);
+    printf("\n");
+
+    unsigned c;
+    for (c = 0; c < sizeof(cookies) / sizeof(*cookies); ++c) {
+        int length = build_request(request, cookies[c]);
+        char label[32];
+        sprintf(label, "%d bytes", length);
+        printf("%-16s", label);
+        for (m = 0; m < MODES; ++m) {
+            double mb = measure(m, request, length, buffer,
+                milliseconds * 1000000);
+            if (mb < 0) {
+                printf("\nERROR: The %s parse went wrong.\n", mode_names[m]);
+                return 1;
+            }
+            printf("%9.1f MB/s", mb);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,249 @@
+/* request_parser.h */
+
+/*
+The incremental HTTP request parser, with the slices it records and 
+percent-decoding for request paths. Used by web_server, and measured on its 
+own by parse_bench. Include chap07.h first.
+*/
+
+#ifndef REQUEST_PARSER_H
+#define REQUEST_PARSER_H
+
+#include "../chapter6/http_scan.h"
+
+#define MAX_HEADERS 32
+
+/*
+A part of the request, given by its offset in the client's request buffer 
+and its length. Using an offset rather than a pointer means a slice still 
+makes sense after the buffer's contents have moved.
+*/
+struct slice {
+    int start;
+    int length;
+};
+
+struct http_header {
+    struct slice name;
+    struct slice value;
+};
+
+/*
+The progress of parsing one request (see REQUEST PARSER below) and the 
+parts found so far. scan is the offset of the next byte to examine and mark 
+the start of the part currently being parsed. The target is split into its 
+path and query once the request is complete.
+*/
+struct http_request {
+    int state;
+    int scan;
+    int mark;
+    struct slice method;
+    struct slice target;
+    struct slice version;
+    struct http_header headers[MAX_HEADERS];
+    int header_count;
+    /* Length of the complete request, including the blank line. */
+    int length;
+    struct slice path;
+    struct slice query;
+};
+
+/*
+REQUEST PARSER
+
+Requests are parsed incrementally as their bytes arrive. parse_request() 
+remembers in the client's http_request how far it got, so each call only 
+looks at bytes it hasn't seen before, however many pieces a slow client 
+splits its request into. It is a small state machine: the state says what 
+the parser is in the middle of (the method, the target, a header name, ...) 
+and each byte either extends that part or finishes it.
+
+Nothing is copied; the method, target, version and each header are recorded 
+as slices of the request buffer.
+
+Returns 1 once the blank line ending the header has been parsed, 0 if more 
+bytes are needed, or -1 if the request is malformed.
+*/
+enum { P_METHOD, P_TARGET, P_VERSION, P_REQUEST_LF, P_HEADER_START, 
+    P_HEADER_NAME, P_HEADER_VALUE_START, P_HEADER_VALUE, P_HEADER_LF, 
+    P_END_LF };
+
+/* Characters allowed in methods and header names (RFC 9110 "tchar"). */
+static inline int is_token_char(unsigned char ch) {
+    if (ch >= '0' && ch <= '9') return 1;
+    if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'z') return 1;
+    return ch && strchr("!#$%&'*+-.^_`|~", ch) != 0;
+}
+
+static inline void parser_reset(struct http_request* req) {
+    req->state = P_METHOD;
+    req->scan = 0;
+    req->mark = 0;
+    req->header_count = 0;
+    req->length = 0;
+}
+
+static inline struct slice make_slice(int start, int end) {
+    struct slice s;
+    s.start = start;
+    s.length = end - start;
+    return s;
+}
+
+static inline int parse_request(struct http_request* req, const char* buffer, 
+        int received) {
+    const char* stop;
+    for (; req->scan < received; ++req->scan) {
+        unsigned char ch = buffer[req->scan];
+
+        switch (req->state) {
+        case P_METHOD:
+            /*
+            Rather than stepping through the method a byte at a time, jump 
+            over its token characters to the first byte that isn't one, 
+            which must be the space after it.
+            */
+            stop = scan_tchar_end(buffer + req->scan, buffer + received);
+            if (!stop) {
+                req->scan = received;
+                return 0;
+            }
+            req->scan = stop - buffer;
+            if (*stop != ' ' || req->scan == req->mark) return -1;
+            req->method = make_slice(req->mark, req->scan);
+            req->mark = req->scan + 1;
+            req->state = P_TARGET;
+            break;
+
+        case P_TARGET:
+            /*
+            Likewise, jump straight to the space that ends the target (or 
+            to a control character, which isn't allowed in it).
+            */
+            stop = scan_token_end(buffer + req->scan, buffer + received, ' ');
+            if (!stop) {
+                req->scan = received;
+                return 0;
+            }
+            req->scan = stop - buffer;
+            if (*stop != ' ' || req->scan == req->mark) return -1;
+            req->target = make_slice(req->mark, req->scan);
+            req->mark = req->scan + 1;
+            req->state = P_VERSION;
+            break;
+
+        case P_VERSION:
+            if (ch == '\r') {
+                req->version = make_slice(req->mark, req->scan);
+                req->state = P_REQUEST_LF;
+            } else if (ch <= ' ') {
+                return -1;
+            }
+            break;
+
+        case P_REQUEST_LF:
+        case P_HEADER_LF:
+            if (ch != '\n') return -1;
+            req->state = P_HEADER_START;
+            break;
+
+        case P_HEADER_START:
+            if (ch == '\r') {
+                req->state = P_END_LF;
+            } else if (is_token_char(ch)) {
+                req->mark = req->scan;
+                req->state = P_HEADER_NAME;
+            } else {
+                return -1;
+            }
+            break;
+
+        case P_HEADER_NAME:
+            /* Likewise for the name, which must be followed by the ':'. */
+            stop = scan_tchar_end(buffer + req->scan, buffer + received);
+            if (!stop) {
+                req->scan = received;
+                return 0;
+            }
+            req->scan = stop - buffer;
+            if (*stop != ':' || req->header_count == MAX_HEADERS) return -1;
+            req->headers[req->header_count].name = 
+                make_slice(req->mark, req->scan);
+            req->state = P_HEADER_VALUE_START;
+            break;
+
+        case P_HEADER_VALUE_START:
+            /* Skip the whitespace in front of the value. */
+            if (ch == ' ' || ch == '\t') break;
+            req->mark = req->scan;
+            req->state = P_HEADER_VALUE;
+            /* fall through */
+
+        case P_HEADER_VALUE:
+            /* Likewise, jump to the "\r" ending the value. */
+            stop = scan_token_end(buffer + req->scan, buffer + received, 
+                '\r');
+            if (!stop) {
+                req->scan = received;
+                return 0;
+            }
+            req->scan = stop - buffer;
+            ch = *stop;
+
+            if (ch == '\r') {
+                /* Trailing whitespace isn't part of the value either. */
+                int end = req->scan;
+                while (end > req->mark && 
+                    (buffer[end - 1] == ' ' || buffer[end - 1] == '\t')) {
+                    --end;
+                }
+                req->headers[req->header_count++].value = 
+                    make_slice(req->mark, end);
+                req->state = P_HEADER_LF;
+            } else if (ch != '\t') {
+                /* Tabs are allowed; any other control character isn't. */
+                return -1;
+            }
+            break;
+
+        case P_END_LF:
+            if (ch != '\n') return -1;
+            req->length = ++req->scan;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline int hex_value(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f') return (ch | 0x20) - 'a' + 10;
+    return -1;
+}
+
+/*
+Decodes %XX escapes in the length bytes at src into dst, which must have 
+room for length + 1 bytes, and null terminates the result. An escape that 
+isn't two hex digits, or that decodes to a null byte, is an error (-1); 
+otherwise the decoded length is returned.
+*/
+static inline int percent_decode(char* dst, const char* src, int length) {
+    int i, out = 0;
+    for (i = 0; i < length; ++i) {
+        if (src[i] != '%') {
+            dst[out++] = src[i];
+            continue;
+        }
+        if (i + 2 >= length) return -1;
+        int high = hex_value(src[i + 1]);
+        int low = hex_value(src[i + 2]);
+        if (high < 0 || low < 0 || (high == 0 && low == 0)) return -1;
+        dst[out++] = (char) (high * 16 + low);
+        i += 2;
+    }
+    dst[out] = 0;
+    return out;
+}
+
+#endif /* REQUEST_PARSER_H */
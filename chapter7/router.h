@@ -0,0 +1,308 @@
+/* router.h */
+
+/*
+A request router: handlers are registered for a method and a path pattern,
+and each request is dispatched to the handler whose pattern its path
+matches. Used by web_server, and measured on its own by route_bench.
+Include chap07.h first.
+
+Patterns are made of literal text and two kinds of captures. ":name"
+matches one segment of the path (up to the next slash) and captures it as
+name, so "/time/:format" matches /time/unix with format "unix". "*name"
+matches the whole rest of the path, slashes included, and has to come last:
+"/static/" followed by "*path" matches /static/css/site.css with path
+"css/site.css".
+
+When several patterns match a path, literal text wins over a ":" capture,
+which wins over a "*" capture, so a "*" capture straight after the first
+slash catches whatever no other route does.
+
+The patterns are kept in a radix tree (a "compressed" trie). Each node
+holds a run of literal text, shared by every pattern below it, and the
+children below a node start with different characters, so at each node at
+most one child can match and it is found by its first character. Looking a
+path up walks down the tree comparing each character of the path about
+once, however many routes there are. (A ":" capture may have to give way to
+a literal route or a "*" capture that matches after all, in which case the
+lookup backs up and tries the next kind; with sensible routes that is
+rare.)
+
+The tree is built before the server starts, and only read afterwards, so
+all the workers share one.
+*/
+
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#define ROUTE_MAX_PARAMS 8
+
+enum {
+    ROUTE_GET, ROUTE_HEAD, ROUTE_POST, ROUTE_PUT, ROUTE_DELETE,
+    ROUTE_OPTIONS, ROUTE_PATCH, ROUTE_METHODS
+};
+static const char* route_method_names[ROUTE_METHODS] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH"
+};
+
+struct route_param {
+    const char* name;
+    const char* value;
+    int length;
+};
+
+/* What a lookup found: the captures, pointing into the path looked up. */
+struct route_match {
+    const char* path;
+    int path_length;
+    int param_count;
+    struct route_param params[ROUTE_MAX_PARAMS];
+    /* With no handler for the method, the methods the path does have. */
+    int allowed;
+};
+
+/*
+A handler is called with whatever context its caller passes along (the
+client, in web_server) and the match router_match() filled in.
+*/
+typedef void (*route_handler)(void* context, struct route_match* match);
+
+struct route_node {
+    /* The literal text this node matches. */
+    char* text;
+    int length;
+    /* Literal children, and the first character of each. */
+    struct route_node** children;
+    char* first;
+    int child_count;
+    /* A ":" capture and a "*" capture following this node's text. */
+    struct route_node* param;
+    char* param_name;
+    struct route_node* rest;
+    char* rest_name;
+    /* Handlers for a pattern ending here, and how many there are. */
+    route_handler handlers[ROUTE_METHODS];
+    int handler_count;
+};
+
+struct router {
+    struct route_node root;
+    int routes;
+};
+
+/* Returns the ROUTE_ index of a method name, or -1 if it isn't one. */
+static inline int route_method(const char* name, int length) {
+    int i;
+    for (i = 0; i < ROUTE_METHODS; ++i) {
+        if ((int) strlen(route_method_names[i]) == length &&
+            memcmp(route_method_names[i], name, length) == 0) return i;
+    }
+    return -1;
+}
+
+static inline struct route_node* route_node_new(const char* text,
+        int length) {
+    struct route_node* n = (struct route_node*) calloc(1, sizeof(*n));
+    if (!n || !(n->text = strndup(text, length))) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    n->length = length;
+    return n;
+}
+
+static inline void route_add_child(struct route_node* n,
+        struct route_node* child) {
+    n->children = (struct route_node**) realloc(n->children,
+        (n->child_count + 1) * sizeof(*n->children));
+    n->first = (char*) realloc(n->first, n->child_count + 1);
+    if (!n->children || !n->first) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    n->children[n->child_count] = child;
+    n->first[n->child_count] = child->text[0];
+    ++n->child_count;
+}
+
+/*
+Splits n after its first at characters: n keeps that much of its text, and
+a new child takes the rest along with everything that was below n.
+*/
+static inline void route_split(struct route_node* n, int at) {
+    struct route_node* tail = route_node_new(n->text + at, n->length - at);
+    tail->children = n->children;
+    tail->first = n->first;
+    tail->child_count = n->child_count;
+    tail->param = n->param;
+    tail->param_name = n->param_name;
+    tail->rest = n->rest;
+    tail->rest_name = n->rest_name;
+    memcpy(tail->handlers, n->handlers, sizeof(n->handlers));
+    tail->handler_count = n->handler_count;
+
+    n->length = at;
+    n->text[at] = 0;
+    n->children = 0;
+    n->first = 0;
+    n->child_count = 0;
+    n->param = n->rest = 0;
+    n->param_name = n->rest_name = 0;
+    memset(n->handlers, 0, sizeof(n->handlers));
+    n->handler_count = 0;
+    route_add_child(n, tail);
+}
+
+/*
+Registers handler for method (a name such as "GET") and pattern. Returns 0,
+or -1 if the pattern is malformed or clashes with one already registered:
+the same route twice, a "*" capture that isn't last, too many captures, or
+two captures in the same place with different names.
+*/
+static inline int router_add(struct router* r, const char* method,
+        const char* pattern, route_handler handler) {
+    int m = route_method(method, strlen(method));
+    if (m < 0 || *pattern != '/') return -1;
+
+    int captures = 0;
+    const char* p;
+    for (p = pattern; *p; ++p) captures += *p == ':' || *p == '*';
+    if (captures > ROUTE_MAX_PARAMS) return -1;
+
+    struct route_node* n = &r->root;
+    while (*pattern) {
+        if (*pattern == ':' || *pattern == '*') {
+            const char* name = pattern + 1;
+            int length = strcspn(name, "/");
+            if (!length || (*pattern == '*' && name[length])) return -1;
+
+            struct route_node** child = *pattern == ':' ? &n->param :
+                &n->rest;
+            char** child_name = *pattern == ':' ? &n->param_name :
+                &n->rest_name;
+            if (!*child) {
+                *child = route_node_new("", 0);
+                *child_name = strndup(name, length);
+            } else if ((int) strlen(*child_name) != length ||
+                    strncmp(*child_name, name, length)) {
+                return -1;
+            }
+            n = *child;
+            pattern = name + length;
+            continue;
+        }
+
+        /* Literal text, up to the next capture. */
+        int length = strcspn(pattern, ":*");
+        const char* f = n->child_count ?
+            memchr(n->first, pattern[0], n->child_count) : 0;
+        if (!f) {
+            struct route_node* child = route_node_new(pattern, length);
+            route_add_child(n, child);
+            n = child;
+            pattern += length;
+            continue;
+        }
+
+        /* Follow the child as far as it agrees, splitting it if need be. */
+        struct route_node* child = n->children[f - n->first];
+        int common = 0;
+        while (common < length && common < child->length &&
+            child->text[common] == pattern[common]) ++common;
+        if (common < child->length) route_split(child, common);
+        n = child;
+        pattern += common;
+    }
+
+    if (n->handlers[m]) return -1;
+    n->handlers[m] = handler;
+    ++n->handler_count;
+    ++r->routes;
+    return 0;
+}
+
+/*
+Finds the node where path (whose first length characters remain, below n)
+ends a pattern, filling in the captures. Returns null if none does.
+*/
+static inline struct route_node* route_find(struct route_node* n,
+        const char* path, int length, struct route_match* match) {
+    if (length == 0 && n->handler_count) return n;
+
+    if (length > 0 && n->child_count) {
+        const char* f = memchr(n->first, path[0], n->child_count);
+        if (f) {
+            struct route_node* child = n->children[f - n->first];
+            if (child->length <= length &&
+                    memcmp(child->text, path, child->length) == 0) {
+                struct route_node* found = route_find(child,
+                    path + child->length, length - child->length, match);
+                if (found) return found;
+            }
+        }
+    }
+
+    if (n->param && length > 0 && path[0] != '/') {
+        const char* slash = memchr(path, '/', length);
+        int segment = slash ? slash - path : length;
+        struct route_param* param = &match->params[match->param_count++];
+        param->name = n->param_name;
+        param->value = path;
+        param->length = segment;
+        struct route_node* found = route_find(n->param, path + segment,
+            length - segment, match);
+        if (found) return found;
+        --match->param_count;
+    }
+
+    if (n->rest && n->rest->handler_count) {
+        struct route_param* param = &match->params[match->param_count++];
+        param->name = n->rest_name;
+        param->value = path;
+        param->length = length;
+        return n->rest;
+    }
+    return 0;
+}
+
+/*
+Looks up the handler for method (a ROUTE_ index) and the path of the given
+length. A HEAD request falls back to the GET handler. Returns null if there
+is none, in which case match->allowed has a bit (1 << ROUTE_...) for each
+method the path does have a handler for, or is 0 if no route matches it.
+*/
+static inline route_handler router_match(struct router* r, int method,
+        const char* path, int length, struct route_match* match) {
+    match->path = path;
+    match->path_length = length;
+    match->param_count = 0;
+    match->allowed = 0;
+
+    struct route_node* n = route_find(&r->root, path, length, match);
+    if (!n) return 0;
+    if (n->handlers[method]) return n->handlers[method];
+    if (method == ROUTE_HEAD && n->handlers[ROUTE_GET]) {
+        return n->handlers[ROUTE_GET];
+    }
+
+    int i;
+    for (i = 0; i < ROUTE_METHODS; ++i) {
+        if (n->handlers[i]) match->allowed |= 1 << i;
+    }
+    if (n->handlers[ROUTE_GET]) match->allowed |= 1 << ROUTE_HEAD;
+    return 0;
+}
+
+/* Returns the value captured as name, setting *length, or null. */
+static inline const char* route_param(struct route_match* match,
+        const char* name, int* length) {
+    int i;
+    for (i = 0; i < match->param_count; ++i) {
+        if (strcmp(match->params[i].name, name) == 0) {
+            *length = match->params[i].length;
+            return match->params[i].value;
+        }
+    }
+    return 0;
+}
+
+#endif /* ROUTER_H */
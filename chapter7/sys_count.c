@@ -0,0 +1,288 @@
+/* sys_count.c */
+
+/*
+CHAPTER 7:  Counting the system calls web_server makes per request
+
+To execute: gcc -O2 sys_count.c -o sys_count
+            ./sys_count [-b] PID COMMAND [ARGUMENTS...]
+
+For example, with web_server running as process 1234:
+
+            ./sys_count 1234 ./web_load -k -c 100 -d 10 \
+                http://127.0.0.1:8080/index.html
+
+Counts every system call made by every thread of process PID while COMMAND
+runs, then prints the total, how many that is per request and how much CPU
+time PID used per request; with -b, also the calls it made most, by name.
+COMMAND is meant to be web_load, whose "N requests in" line gives the
+number of requests; its output is passed through as it is. Running the
+same web_load against web_server with and without --io-uring (or against
+an older build of it) shows what each event loop costs per request, in
+system calls and in CPU.
+
+The counting is what "perf stat -e raw_syscalls:sys_enter" does: a kernel
+performance counter on the raw_syscalls:sys_enter tracepoint for each
+thread. The counter is kept by the kernel as the calls are made, so unlike
+strace -c, which stops the process twice on every call, it doesn't slow
+web_server down and change what is being measured. (A server slowed down
+finds more events waiting each time it asks, and so makes fewer calls per
+request than it would otherwise.) The -b breakdown adds a counter on each
+of the several hundred syscalls:sys_enter_NAME tracepoints, and every call
+then costs enough more that it does slow web_server down, by as much as
+three times; so take the requests per second and the total from a run
+without it, and only the proportions from a run with it.
+
+The tracepoint numbers are read from tracefs, so it must be mounted (at
+/sys/kernel/tracing or /sys/kernel/debug/tracing), and opening the counters
+needs root or a low enough /proc/sys/kernel/perf_event_paranoid. Only the
+threads PID has when COMMAND starts are counted; web_server starts all of
+its workers before it accepts anything.
+*/
+
+#define _GNU_SOURCE
+#include "chap07.h"
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+#define MAX_THREADS 256
+#define MAX_NAMES 512
+
+struct counter {
+    char name[64];
+    int fds[MAX_THREADS];
+    uint64_t count;
+};
+
+static const char* tracefs;
+static pid_t threads[MAX_THREADS];
+static int thread_count;
+static struct counter total;
+static struct counter names[MAX_NAMES];
+static int name_count;
+
+void fail(const char* what) {
+    fprintf(stderr, "ERROR: %s failed. (%d)\n", what, errno);
+    exit(1);
+}
+
+/* Finds where tracefs is mounted. */
+int find_tracefs() {
+    static const char* places[] = {
+        "/sys/kernel/tracing", "/sys/kernel/debug/tracing" };
+    unsigned i;
+    for (i = 0; i < sizeof(places) / sizeof(*places); ++i) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/events/raw_syscalls", places[i]);
+        if (access(path, R_OK) == 0) {
+            tracefs = places[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Returns the id of the tracepoint events/group/name, or -1. */
+long long tracepoint_id(const char* group, const char* name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/events/%s/%s/id", tracefs, group, name);
+    FILE* fp = fopen(path, "r");
+    long long id = -1;
+    if (fp) {
+        if (fscanf(fp, "%lld", &id) != 1) id = -1;
+        fclose(fp);
+    }
+    return id;
+}
+
+/* Lists the threads of pid. */
+void find_threads(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", (int) pid);
+    DIR* dir = opendir(path);
+    if (!dir) fail("Reading the process's threads");
+    struct dirent* entry;
+    while ((entry = readdir(dir)) && thread_count < MAX_THREADS) {
+        if (entry->d_name[0] == '.') continue;
+        threads[thread_count++] = atoi(entry->d_name);
+    }
+    closedir(dir);
+}
+
+/*
+Opens a counter of the given tracepoint on every thread, disabled until it
+is enabled. Returns 0 if the tracepoint can't be counted.
+*/
+int open_counter(struct counter* counter, long long id) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof(attr);
+    attr.config = id;
+    attr.disabled = 1;
+
+    int t;
+    for (t = 0; t < thread_count; ++t) {
+        counter->fds[t] = syscall(SYS_perf_event_open, &attr, threads[t],
+            -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (counter->fds[t] < 0) {
+            while (t--) close(counter->fds[t]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void control_counter(struct counter* counter, unsigned long request) {
+    int t;
+    for (t = 0; t < thread_count; ++t) {
+        ioctl(counter->fds[t], request, 0);
+    }
+}
+
+void read_counter(struct counter* counter) {
+    counter->count = 0;
+    int t;
+    for (t = 0; t < thread_count; ++t) {
+        uint64_t value;
+        if (read(counter->fds[t], &value, sizeof(value)) == sizeof(value)) {
+            counter->count += value;
+        }
+        close(counter->fds[t]);
+    }
+}
+
+/* Opens a counter for each syscalls:sys_enter_NAME tracepoint there is. */
+void open_name_counters() {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/events/syscalls", tracefs);
+    DIR* dir = opendir(path);
+    if (!dir) return;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) && name_count < MAX_NAMES) {
+        if (strncmp(entry->d_name, "sys_enter_", 10)) continue;
+        long long id = tracepoint_id("syscalls", entry->d_name);
+        struct counter* counter = &names[name_count];
+        if (id < 0 || !open_counter(counter, id)) continue;
+        snprintf(counter->name, sizeof(counter->name), "%s",
+            entry->d_name + 10);
+        ++name_count;
+    }
+    closedir(dir);
+}
+
+/* Returns the user plus system CPU time pid has used, in seconds. */
+double cpu_seconds(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    FILE* fp = fopen(path, "r");
+    if (!fp) return 0;
+    char line[1024];
+    double seconds = 0;
+    if (fgets(line, sizeof(line), fp)) {
+        /* Fields 14 and 15, counted after the ")" that ends the name. */
+        const char* p = strrchr(line, ')');
+        unsigned long utime, stime;
+        if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                "%lu %lu", &utime, &stime) == 2) {
+            seconds = (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+        }
+    }
+    fclose(fp);
+    return seconds;
+}
+
+int by_count(const void* a, const void* b) {
+    const struct counter* x = a;
+    const struct counter* y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    int breakdown = argc > 1 && strcmp(argv[1], "-b") == 0;
+    argc -= breakdown;
+    argv += breakdown;
+    pid_t pid = argc > 2 ? atoi(argv[1]) : 0;
+    if (pid <= 0) {
+        fprintf(stderr,
+            "Usage: ./sys_count [-b] PID COMMAND [ARGUMENTS...]\n");
+        return 1;
+    }
+    if (!find_tracefs()) {
+        fprintf(stderr, "ERROR: tracefs isn't mounted. Try:\n"
+            "    mount -t tracefs nodev /sys/kernel/tracing\n");
+        return 1;
+    }
+
+    find_threads(pid);
+    long long id = tracepoint_id("raw_syscalls", "sys_enter");
+    if (id < 0 || !open_counter(&total, id)) {
+        fail("Opening the counters (are you root?)");
+    }
+    if (breakdown) open_name_counters();
+
+    /* COMMAND's output comes through a pipe, to find the request count. */
+    int pipes[2];
+    if (pipe(pipes)) fail("pipe()");
+
+    double cpu = cpu_seconds(pid);
+    int n;
+    control_counter(&total, PERF_EVENT_IOC_ENABLE);
+    for (n = 0; n < name_count; ++n) {
+        control_counter(&names[n], PERF_EVENT_IOC_ENABLE);
+    }
+
+    pid_t child = fork();
+    if (child < 0) fail("fork()");
+    if (child == 0) {
+        dup2(pipes[1], 1);
+        close(pipes[0]);
+        close(pipes[1]);
+        execvp(argv[2], argv + 2);
+        fprintf(stderr, "ERROR: Can't run %s. (%d)\n", argv[2], errno);
+        _exit(127);
+    }
+    close(pipes[1]);
+
+    FILE* output = fdopen(pipes[0], "r");
+    char line[1024];
+    unsigned long requests = 0;
+    while (fgets(line, sizeof(line), output)) {
+        fputs(line, stdout);
+        unsigned long r;
+        if (sscanf(line, " %lu requests in", &r) == 1) requests = r;
+    }
+    fclose(output);
+    int status;
+    waitpid(child, &status, 0);
+
+    control_counter(&total, PERF_EVENT_IOC_DISABLE);
+    for (n = 0; n < name_count; ++n) {
+        control_counter(&names[n], PERF_EVENT_IOC_DISABLE);
+    }
+    cpu = cpu_seconds(pid) - cpu;
+    read_counter(&total);
+    for (n = 0; n < name_count; ++n) read_counter(&names[n]);
+
+    printf("\nProcess %d, %d threads: %llu system calls", (int) pid,
+        thread_count, (unsigned long long) total.count);
+    if (requests) {
+        printf(", %.2f per request, %.1f us CPU per request\n",
+            (double) total.count / requests, cpu * 1e6 / requests);
+    } else {
+        printf(", %.2f s CPU (no request count found)\n", cpu);
+    }
+
+    qsort(names, name_count, sizeof(*names), by_count);
+    for (n = 0; n < name_count && names[n].count; ++n) {
+        printf("  %-20s%12llu", names[n].name,
+            (unsigned long long) names[n].count);
+        if (requests) {
+            printf("%10.2f per request", (double) names[n].count / requests);
+        }
+        printf("\n");
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,512 @@
+/* web_load.c */
+
+/*
+CHAPTER 7:  A load generator for web_server
+
+To execute: gcc web_load.c -o web_load -pthread
+            ./web_load [-c CONNECTIONS] [-t THREADS] [-d SECONDS] [-k]
+                [-p DEPTH] [-R REQUESTS_PER_SECOND] [-r] url
+
+Hammers a web server with requests for url for a while, in the manner of
+wrk, then reports how many requests per second it managed and how long they
+took. Everything runs over ordinary sockets, so pointed at web_server on
+127.0.0.1 it measures the server without any network in the way.
+
+    -c  Connections to keep open (default 10), shared between the threads.
+    -t  Threads (default 1), each running its own event loop.
+    -d  How long to run, in seconds (default 10).
+    -k  Keep connections alive. Without it every request is made on a new
+        connection, which measures connection setup as much as anything;
+        the connections made per second are reported too, so run without
+        -k this is a connection storm.
+    -p  Pipelining depth: how many requests may be waiting for a response
+        on one connection at once (default 1; needs -k). web_server closes
+        a connection after --max-requests, and requests already pipelined
+        behind the last one then show up as write errors, so raise that.
+    -R  Send at a fixed total rate instead of as fast as possible.
+    -r  Revalidate: fetch url once first, then send its ETag with every
+        request (If-None-Match), the way a browser or CDN checks whether its
+        cached copy is still current. web_server answers each with a 304 and
+        no body. Comparing a run with and without -r shows the bytes saved,
+        and the cpu_seconds in web_server's /__stats before and after each
+        run shows the CPU saved.
+
+Only responses with a Content-Length are understood, which is all that
+web_server sends (besides 304s, which never have a body).
+*/
+
+#define _GNU_SOURCE
+#include "chap07.h"
+#include "../chapter6/http_scan.h"
+#include "../chapter6/http_client.h"
+#include "histogram.h"
+
+#define RESPONSE_BUFFER 8192
+#define MAX_DEPTH 64
+
+/*
+CLOSED LOOP AND FIXED RATE
+
+By default each connection sends its next request as soon as the previous
+response is in (a "closed loop"), and the latency of a request is simply the
+time from sending it to receiving the last byte of the response.
+
+That under-reports latency badly when the server stalls. While one request
+is stuck for a second, a closed-loop client sends nothing else, so the one
+slow request is recorded once instead of the thousands of requests a real
+user population would have sent during that second and that would all have
+waited. This is called coordinated omission. With -R, requests are
+scheduled at fixed intervals instead, and each request's latency is measured
+from when it was scheduled to be sent, not when it actually was: a request
+that couldn't go out on time because the connection was still waiting counts
+its waiting time too. This is the correction wrk2 makes.
+*/
+struct connection {
+    SOCKET socket;
+    struct thread* thread;
+
+    char response[RESPONSE_BUFFER];
+    int received;
+    /* Body bytes still to come for the response being read; -1 while its
+    header is still arriving. */
+    long body_left;
+    int status;
+    int server_closes;
+
+    /* Start times of the requests waiting for responses, oldest first. */
+    uint64_t starts[MAX_DEPTH];
+    int first;
+    int outstanding;
+
+    /* With -R, when this connection's next request is due. */
+    uint64_t next_due;
+};
+
+struct thread {
+    pthread_t id;
+    int epoll_fd;
+    struct connection* connections;
+    int connection_count;
+
+    unsigned long requests;
+    unsigned long bytes;
+    unsigned long connects;
+    unsigned long connect_errors;
+    unsigned long read_errors;
+    unsigned long write_errors;
+    unsigned long bad_status;
+    unsigned long not_modified;
+    struct histogram latency;
+};
+
+static int connection_count = 10;
+static int thread_count = 1;
+static int duration = 10;
+static int keep_alive = 0;
+static int depth = 1;
+static double rate = 0;
+static int revalidate = 0;
+
+static struct addrinfo* server_address;
+static char request[2048];
+static int request_length;
+
+/* Microseconds between requests on one connection, with -R. */
+static uint64_t interval_us;
+static volatile int running = 1;
+
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+Opens (or reopens) a connection's socket. Requests are small, so sending
+them on a blocking socket is fine; responses are read with MSG_DONTWAIT
+when epoll says there is something to read.
+*/
+int open_connection(struct connection* c) {
+    c->socket = connect_to_address(server_address);
+    if (!ISVALIDSOCKET(c->socket)) {
+        ++c->thread->connect_errors;
+        return -1;
+    }
+    if (running) ++c->thread->connects;
+    int one = 1;
+    setsockopt(c->socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = c;
+    epoll_ctl(c->thread->epoll_fd, EPOLL_CTL_ADD, c->socket, &event);
+
+    c->received = 0;
+    c->body_left = -1;
+    c->first = 0;
+    c->outstanding = 0;
+    return 0;
+}
+
+void close_connection(struct connection* c) {
+    if (!ISVALIDSOCKET(c->socket)) return;
+    CLOSESOCKET(c->socket);
+    c->socket = -1;
+}
+
+/*
+Sends every request the connection may send right now: as many as the
+pipelining depth allows, and with -R only those whose time has come. If the
+connection was lost it is reopened first.
+*/
+void send_due(struct connection* c, uint64_t now) {
+    int max = keep_alive ? depth : 1;
+    while (c->outstanding < max) {
+        if (rate > 0 && c->next_due > now) return;
+        if (!ISVALIDSOCKET(c->socket) && open_connection(c)) return;
+
+        if (send(c->socket, request, request_length, MSG_NOSIGNAL) !=
+                request_length) {
+            ++c->thread->write_errors;
+            close_connection(c);
+            return;
+        }
+
+        int slot = (c->first + c->outstanding) % MAX_DEPTH;
+        if (rate > 0) {
+            c->starts[slot] = c->next_due;
+            c->next_due += interval_us;
+        } else {
+            c->starts[slot] = now;
+        }
+        ++c->outstanding;
+    }
+}
+
+/*
+Reads the header at the front of the buffer once it has all arrived:
+the status code, the body length and whether the server is about to close
+the connection. Returns the header's length, 0 if it isn't all here yet, or
+-1 if it can't be understood.
+*/
+int read_header(struct connection* c) {
+    const char* end = scan_header_end(c->response, c->response + c->received);
+    if (!end) return c->received == RESPONSE_BUFFER ? -1 : 0;
+
+    if (c->received < 12 || strncmp(c->response, "HTTP/1.", 7)) return -1;
+    c->status = atoi(c->response + 9);
+    c->body_left = -1;
+    c->server_closes = 0;
+
+    const char* line = scan_crlf(c->response, end + 2) + 2;
+    while (line < end + 2) {
+        const char* next = scan_crlf(line, end + 2);
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            c->body_left = strtol(line + 15, 0, 10);
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            const char* v = line + 11;
+            while (*v == ' ') ++v;
+            if (strncasecmp(v, "close", 5) == 0) c->server_closes = 1;
+        }
+        line = next + 2;
+    }
+    /* A 304 has no body, whatever its header says. */
+    if (c->status == 304) c->body_left = 0;
+    if (c->body_left < 0) return -1;
+    return end + 4 - c->response;
+}
+
+/* Reads whatever has arrived, and counts each response that is complete. */
+void read_responses(struct connection* c) {
+    struct thread* t = c->thread;
+    while (1) {
+        int r = recv(c->socket, c->response + c->received,
+            RESPONSE_BUFFER - c->received, MSG_DONTWAIT);
+        if (r < 0 && errno == EAGAIN) break;
+        if (r < 1) {
+            /* Losing a connection with requests unanswered is an error. */
+            if (c->outstanding) ++t->read_errors;
+            close_connection(c);
+            return;
+        }
+        t->bytes += r;
+        c->received += r;
+
+        /* Take as many complete responses as the buffer holds. */
+        while (c->received) {
+            if (c->body_left < 0) {
+                int header = read_header(c);
+                if (header == 0) break;
+                if (header < 0) {
+                    ++t->read_errors;
+                    close_connection(c);
+                    return;
+                }
+                memmove(c->response, c->response + header,
+                    c->received - header);
+                c->received -= header;
+            }
+
+            /* The body isn't kept, only counted off. */
+            long take = c->received < c->body_left ? c->received :
+                c->body_left;
+            memmove(c->response, c->response + take, c->received - take);
+            c->received -= take;
+            c->body_left -= take;
+            if (c->body_left) break;
+
+            if (c->outstanding == 0) {
+                /* A response nobody asked for. */
+                ++t->read_errors;
+                close_connection(c);
+                return;
+            }
+            uint64_t now = now_us();
+            if (running) {
+                hist_record(&t->latency, now - c->starts[c->first]);
+                ++t->requests;
+                if (c->status >= 400) ++t->bad_status;
+                if (c->status == 304) ++t->not_modified;
+            }
+            c->first = (c->first + 1) % MAX_DEPTH;
+            --c->outstanding;
+            c->body_left = -1;
+
+            /*
+            Any requests still waiting when the server closes (after its 
+            --max-requests, say) are given up on; the connection is reopened 
+            and starts afresh.
+            */
+            if (c->server_closes || !keep_alive) {
+                close_connection(c);
+                return;
+            }
+        }
+    }
+}
+
+void* thread_main(void* arg) {
+    struct thread* t = (struct thread*) arg;
+    t->epoll_fd = epoll_create1(0);
+    if (t->epoll_fd < 0) {
+        fprintf(stderr, "ERROR: epoll_create1() failed. (%d)\n", errno);
+        return 0;
+    }
+
+    /* Spread the connections' first requests evenly over one interval. */
+    uint64_t start = now_us();
+    int i;
+    for (i = 0; i < t->connection_count; ++i) {
+        struct connection* c = &t->connections[i];
+        c->thread = t;
+        c->socket = -1;
+        c->next_due = start + interval_us * i / t->connection_count;
+        send_due(c, start);
+    }
+
+    struct epoll_event events[64];
+    while (running) {
+        /*
+        Sleep until something arrives, or (with -R) until the next request
+        is due, checking at least every 100ms whether it's time to stop.
+        */
+        int timeout = 100;
+        uint64_t now = now_us();
+        for (i = 0; i < t->connection_count; ++i) {
+            struct connection* c = &t->connections[i];
+            if (rate > 0 && c->next_due > now) {
+                uint64_t wait = (c->next_due - now + 999) / 1000;
+                if (wait < (uint64_t) timeout) timeout = wait;
+            } else if (!ISVALIDSOCKET(c->socket) || (rate > 0 &&
+                    c->outstanding < (keep_alive ? depth : 1))) {
+                timeout = 0;
+            }
+        }
+
+        int n = epoll_wait(t->epoll_fd, events, 64, timeout);
+        for (i = 0; i < n; ++i) {
+            read_responses((struct connection*) events[i].data.ptr);
+        }
+
+        now = now_us();
+        for (i = 0; i < t->connection_count; ++i) {
+            send_due(&t->connections[i], now);
+        }
+    }
+
+    for (i = 0; i < t->connection_count; ++i) {
+        close_connection(&t->connections[i]);
+    }
+    close(t->epoll_fd);
+    return 0;
+}
+
+/*
+With -r: requests url once, on a connection of its own, and adds the ETag 
+the server sent to the request as If-None-Match. Returns -1 if there is no 
+ETag to add.
+*/
+int add_validator(const char* hostname, const char* port, const char* path) {
+    SOCKET s = connect_to_address(server_address);
+    if (!ISVALIDSOCKET(s)) return -1;
+
+    char buffer[RESPONSE_BUFFER + 1];
+    int length = format_request(buffer, hostname, port, path, 0);
+    send(s, buffer, length, MSG_NOSIGNAL);
+
+    /* Only the header is needed. */
+    int received = 0;
+    const char* end = 0;
+    while (!end && received < RESPONSE_BUFFER) {
+        int r = recv(s, buffer + received, RESPONSE_BUFFER - received, 0);
+        if (r < 1) break;
+        received += r;
+        end = scan_header_end(buffer, buffer + received);
+    }
+    CLOSESOCKET(s);
+    if (!end) return -1;
+    buffer[end + 2 - buffer] = 0;
+
+    char* etag = strcasestr(buffer, "\nETag:");
+    if (!etag) return -1;
+    etag += 6;
+    while (*etag == ' ') ++etag;
+    char* etag_end = strstr(etag, "\r\n");
+    if (etag_end - etag > 256) return -1;
+
+    /* Replace the blank line at the end of the request, then put it back. */
+    request_length -= 2;
+    request_length += sprintf(request + request_length, 
+        "If-None-Match: %.*s\r\n\r\n", (int) (etag_end - etag), etag);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    char* url = 0;
+    int a;
+    for (a = 1; a < argc; ++a) {
+        if (strcmp(argv[a], "-c") == 0 && a + 1 < argc) {
+            connection_count = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "-t") == 0 && a + 1 < argc) {
+            thread_count = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "-d") == 0 && a + 1 < argc) {
+            duration = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "-k") == 0) {
+            keep_alive = 1;
+        } else if (strcmp(argv[a], "-p") == 0 && a + 1 < argc) {
+            depth = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "-R") == 0 && a + 1 < argc) {
+            rate = atof(argv[++a]);
+        } else if (strcmp(argv[a], "-r") == 0) {
+            revalidate = 1;
+        } else if (argv[a][0] != '-' && !url) {
+            url = argv[a];
+        } else {
+            url = 0;
+            break;
+        }
+    }
+    if (!url || connection_count < 1 || thread_count < 1 || duration < 1 ||
+            depth < 1 || depth > MAX_DEPTH) {
+        fprintf(stderr, "Usage: ./web_load [-c CONNECTIONS] [-t THREADS] "
+            "[-d SECONDS] [-k] [-p DEPTH (1-%d)] [-R REQUESTS_PER_SECOND] "
+            "[-r] url\n", MAX_DEPTH);
+        return 1;
+    }
+    if (thread_count > connection_count) thread_count = connection_count;
+
+    scan_init();
+
+    char* hostname, *port, *path;
+    parse_url(url, &hostname, &port, &path);
+    server_address = resolve_host(hostname, port);
+    printf("\n");
+    request_length = format_request(request, hostname, port, path,
+        keep_alive);
+    if (revalidate && add_validator(hostname, port, path)) {
+        fprintf(stderr, "ERROR: No ETag to revalidate with.\n");
+        return 1;
+    }
+
+    /* With -R, each connection takes an equal share of the rate. */
+    if (rate > 0) interval_us = (uint64_t) (1e6 * connection_count / rate);
+
+    struct thread* threads = (struct thread*) calloc(thread_count,
+        sizeof(struct thread));
+    struct connection* connections = (struct connection*) calloc(
+        connection_count, sizeof(struct connection));
+    if (!threads || !connections) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        return 1;
+    }
+
+    printf("Running %ds test @ %s:%s/%s\n", duration, hostname, port, path);
+    printf("  %d threads and %d connections, %s, pipelining %d, %s\n",
+        thread_count, connection_count, keep_alive ? "keep-alive" :
+        "a connection per request", keep_alive ? depth : 1,
+        rate > 0 ? "fixed rate" : "closed loop");
+    fflush(stdout);
+
+    int i, given = 0;
+    for (i = 0; i < thread_count; ++i) {
+        struct thread* t = &threads[i];
+        t->connections = connections + given;
+        t->connection_count = (connection_count - given) / (thread_count - i);
+        given += t->connection_count;
+        if (pthread_create(&t->id, 0, thread_main, t)) {
+            fprintf(stderr, "ERROR: pthread_create() failed.\n");
+            return 1;
+        }
+    }
+
+    uint64_t start = now_us();
+    sleep(duration);
+    running = 0;
+    double elapsed = (now_us() - start) / 1e6;
+
+    struct thread total;
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < thread_count; ++i) {
+        struct thread* t = &threads[i];
+        pthread_join(t->id, 0);
+        total.requests += t->requests;
+        total.bytes += t->bytes;
+        total.connects += t->connects;
+        total.connect_errors += t->connect_errors;
+        total.read_errors += t->read_errors;
+        total.write_errors += t->write_errors;
+        total.bad_status += t->bad_status;
+        total.not_modified += t->not_modified;
+        hist_merge(&total.latency, &t->latency);
+    }
+
+    struct histogram* h = &total.latency;
+    printf("  Latency (us):  p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  "
+        "max %llu  mean %.1f\n",
+        (unsigned long long) hist_percentile(h, 0.5),
+        (unsigned long long) hist_percentile(h, 0.9),
+        (unsigned long long) hist_percentile(h, 0.99),
+        (unsigned long long) hist_percentile(h, 0.999),
+        (unsigned long long) h->max, h->count ? (double) h->sum / h->count : 0);
+    printf("  %lu requests in %.2fs, %lu bytes read\n", total.requests,
+        elapsed, total.bytes);
+    if (revalidate) {
+        printf("  %lu answered 304 Not Modified\n", total.not_modified);
+    }
+    if (total.connect_errors || total.read_errors || total.write_errors ||
+            total.bad_status) {
+        printf("  Errors: %lu connect, %lu read, %lu write, "
+            "%lu non-2xx/3xx responses\n", total.connect_errors,
+            total.read_errors, total.write_errors, total.bad_status);
+    }
+    printf("Requests/sec: %.2f\n", total.requests / elapsed);
+    if (!keep_alive) {
+        printf("Connections/sec: %.2f\n", total.connects / elapsed);
+    }
+    printf("Transfer/sec: %.2f KB\n", total.bytes / elapsed / 1024);
+
+    freeaddrinfo(server_address);
+    free(connections);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,324 @@
+/* web_pack.c */
+
+/*
+CHAPTER 7:  Packing public/ into one archive for web_server
+
+To execute: gcc web_pack.c -o web_pack -lz
+            ./web_pack [-n] public site.pack
+            ./web_server --pack site.pack
+
+Reads every file under a directory and writes them into a single archive
+(see pack.h), together with everything web_server would otherwise work out
+per file: the path index, sorted so it can be searched in place, each
+file's Content-Type, its ETag and its header lines. Compressible files also
+get a gzip-compressed body, taken from a .gz sibling if there is an up to
+date one, or else compressed here at zlib's highest level, which would be
+too slow to do while serving. -n leaves the compressed bodies out.
+
+web_server --pack maps the archive into memory once at startup, and from
+then on never looks at public/ at all: a deploy is one file, replaced as a
+whole, and requests are answered by a search in memory. The archive is
+written under a temporary name and renamed into place, so a server starting
+up never sees half of one.
+*/
+
+#define _GNU_SOURCE
+#include "chap07.h"
+#include "file_header.h"
+#include "pack.h"
+#include <dirent.h>
+#include <zlib.h>
+
+#define MAX_PACK_PATH 1024
+
+struct packed_file {
+    char path[MAX_PACK_PATH];
+    char disk_path[MAX_PACK_PATH];
+    struct stat st;
+    char* body;
+    char* gzip;
+    size_t gzip_length;
+};
+
+static struct packed_file* files;
+static int file_count;
+static int file_capacity;
+static int precompress = 1;
+
+/* The string table, built up as the entries are. */
+static char* strings;
+static size_t strings_length;
+static size_t strings_capacity;
+
+void* must_alloc(void* p) {
+    if (!p) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    return p;
+}
+
+/* Adds text to the string table and returns its offset. */
+uint32_t add_string(const char* text) {
+    size_t length = strlen(text) + 1;
+    while (strings_length + length > strings_capacity) {
+        strings_capacity = strings_capacity ? strings_capacity * 2 : 65536;
+        strings = must_alloc(realloc(strings, strings_capacity));
+    }
+    memcpy(strings + strings_length, text, length);
+    strings_length += length;
+    return strings_length - length;
+}
+
+/*
+Collects the regular files under disk_path, which is requested as path.
+Hidden files (starting with a dot) are left out.
+*/
+void collect(const char* disk_path, const char* path) {
+    DIR* dir = opendir(disk_path);
+    if (!dir) {
+        fprintf(stderr, "ERROR: Can't read %s. (%d)\n", disk_path, errno);
+        exit(1);
+    }
+
+    struct dirent* d;
+    while ((d = readdir(dir))) {
+        if (d->d_name[0] == '.') continue;
+
+        char child_disk[MAX_PACK_PATH], child[MAX_PACK_PATH];
+        if (snprintf(child_disk, sizeof(child_disk), "%s/%s", disk_path,
+                d->d_name) >= (int) sizeof(child_disk) ||
+            snprintf(child, sizeof(child), "%s/%s", path, d->d_name) >=
+                (int) sizeof(child)) {
+            fprintf(stderr, "WARNING: Skipping %s/%s, path too long.\n",
+                disk_path, d->d_name);
+            continue;
+        }
+
+        struct stat st;
+        if (stat(child_disk, &st)) continue;
+        if (S_ISDIR(st.st_mode)) {
+            collect(child_disk, child);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) continue;
+
+        if (file_count == file_capacity) {
+            file_capacity = file_capacity ? file_capacity * 2 : 256;
+            files = must_alloc(realloc(files,
+                file_capacity * sizeof(*files)));
+        }
+        struct packed_file* f = &files[file_count++];
+        memset(f, 0, sizeof(*f));
+        strcpy(f->path, child);
+        strcpy(f->disk_path, child_disk);
+        f->st = st;
+    }
+    closedir(dir);
+}
+
+int compare_files(const void* a, const void* b) {
+    return strcmp(((const struct packed_file*) a)->path,
+        ((const struct packed_file*) b)->path);
+}
+
+/* Reads length bytes of the file at path, or returns null. */
+char* read_file(const char* path, size_t length) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    char* data = must_alloc(malloc(length ? length : 1));
+    size_t got = 0;
+    while (got < length) {
+        ssize_t r = read(fd, data + got, length - got);
+        if (r < 1) break;
+        got += r;
+    }
+    close(fd);
+    if (got < length) {
+        free(data);
+        return 0;
+    }
+    return data;
+}
+
+/*
+Finds a gzip body for f: its .gz sibling if that is at least as new as the
+file, or else the file compressed here. Only kept if it is smaller.
+*/
+void compress_body(struct packed_file* f) {
+    char sibling[MAX_PACK_PATH + 4];
+    sprintf(sibling, "%s.gz", f->disk_path);
+    struct stat st;
+    if (!stat(sibling, &st) && S_ISREG(st.st_mode) &&
+            st.st_mtime >= f->st.st_mtime) {
+        f->gzip_length = st.st_size;
+        f->gzip = read_file(sibling, st.st_size);
+    }
+
+    if (!f->gzip) {
+        /* windowBits of 15 + 16 asks for the gzip format. */
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                Z_DEFAULT_STRATEGY) != Z_OK) return;
+        size_t bound = deflateBound(&z, f->st.st_size);
+        f->gzip = must_alloc(malloc(bound));
+        z.next_in = (Bytef*) f->body;
+        z.avail_in = f->st.st_size;
+        z.next_out = (Bytef*) f->gzip;
+        z.avail_out = bound;
+        int result = deflate(&z, Z_FINISH);
+        f->gzip_length = z.total_out;
+        deflateEnd(&z);
+        if (result != Z_STREAM_END) {
+            free(f->gzip);
+            f->gzip = 0;
+        }
+    }
+
+    if (f->gzip && f->gzip_length >= (size_t) f->st.st_size) {
+        free(f->gzip);
+        f->gzip = 0;
+    }
+}
+
+/* Writes length bytes to out, exiting on failure. */
+void write_all(FILE* out, const void* data, size_t length) {
+    if (length && fwrite(data, 1, length, out) != length) {
+        fprintf(stderr, "ERROR: Write failed. (%d)\n", errno);
+        exit(1);
+    }
+}
+
+/* Pads out with zeros up to the next multiple of PACK_ALIGN. */
+void write_padding(FILE* out, uint64_t* offset) {
+    static const char zeros[PACK_ALIGN];
+    size_t pad = (PACK_ALIGN - *offset % PACK_ALIGN) % PACK_ALIGN;
+    write_all(out, zeros, pad);
+    *offset += pad;
+}
+
+int main(int argc, char* argv[]) {
+    int a = 1;
+    if (a < argc && strcmp(argv[a], "-n") == 0) {
+        precompress = 0;
+        ++a;
+    }
+    if (argc - a != 2) {
+        fprintf(stderr, "Usage: ./web_pack [-n] DIRECTORY OUTPUT\n");
+        return 1;
+    }
+    const char* directory = argv[a];
+    const char* output = argv[a + 1];
+
+    collect(directory, "");
+    if (!file_count) {
+        fprintf(stderr, "ERROR: No files in %s.\n", directory);
+        return 1;
+    }
+    qsort(files, file_count, sizeof(*files), compare_files);
+
+    /*
+    First everything is read and the entries filled in, which settles how
+    long the string table is and so where the bodies will start.
+    */
+    struct pack_entry* entries = must_alloc(calloc(file_count,
+        sizeof(*entries)));
+    add_string("");
+    size_t body_bytes = 0, gzip_bytes = 0;
+    int i;
+    for (i = 0; i < file_count; ++i) {
+        struct packed_file* f = &files[i];
+        struct pack_entry* e = &entries[i];
+        f->body = read_file(f->disk_path, f->st.st_size);
+        if (!f->body) {
+            fprintf(stderr, "ERROR: Can't read %s.\n", f->disk_path);
+            return 1;
+        }
+        const char* content_type = get_content_type(f->path);
+        if (precompress && is_compressible(content_type)) compress_body(f);
+
+        char etag[64], header[512];
+        format_etag(etag, f->st.st_ino, f->st.st_size, f->st.st_mtime);
+        format_file_header(header, etag, content_type, 0, f->st.st_size,
+            f->st.st_mtime);
+        e->path = add_string(f->path);
+        e->content_type = add_string(content_type);
+        e->etag = add_string(etag);
+        e->header = add_string(header);
+        e->mtime = f->st.st_mtime;
+        e->body_length = f->st.st_size;
+        body_bytes += f->st.st_size;
+
+        if (f->gzip) {
+            /* The variant's tag is the file's, marked with the encoding. */
+            char gzip_etag[80];
+            sprintf(gzip_etag, "%.*s-gzip\"", (int) strlen(etag) - 1, etag);
+            format_file_header(header, gzip_etag, content_type, "gzip",
+                f->gzip_length, f->st.st_mtime);
+            e->gzip_etag = add_string(gzip_etag);
+            e->gzip_header = add_string(header);
+            e->gzip_length = f->gzip_length;
+            gzip_bytes += f->gzip_length;
+        }
+    }
+
+    struct pack_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, 8);
+    header.count = file_count;
+    header.strings = sizeof(header) + file_count * sizeof(*entries);
+    header.strings_length = strings_length;
+
+    /* Now the body offsets, each aligned. */
+    uint64_t offset = header.strings + strings_length;
+    for (i = 0; i < file_count; ++i) {
+        offset += (PACK_ALIGN - offset % PACK_ALIGN) % PACK_ALIGN;
+        entries[i].body = offset;
+        offset += entries[i].body_length;
+        if (files[i].gzip) {
+            offset += (PACK_ALIGN - offset % PACK_ALIGN) % PACK_ALIGN;
+            entries[i].gzip_body = offset;
+            offset += entries[i].gzip_length;
+        }
+    }
+
+    char temporary[MAX_PACK_PATH];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", output);
+    FILE* out = fopen(temporary, "wb");
+    if (!out) {
+        fprintf(stderr, "ERROR: Can't create %s. (%d)\n", temporary, errno);
+        return 1;
+    }
+    write_all(out, &header, sizeof(header));
+    write_all(out, entries, file_count * sizeof(*entries));
+    write_all(out, strings, strings_length);
+    offset = header.strings + strings_length;
+    for (i = 0; i < file_count; ++i) {
+        write_padding(out, &offset);
+        write_all(out, files[i].body, entries[i].body_length);
+        offset += entries[i].body_length;
+        if (files[i].gzip) {
+            write_padding(out, &offset);
+            write_all(out, files[i].gzip, files[i].gzip_length);
+            offset += files[i].gzip_length;
+        }
+    }
+    if (fclose(out) || rename(temporary, output)) {
+        fprintf(stderr, "ERROR: Can't write %s. (%d)\n", output, errno);
+        return 1;
+    }
+
+    printf("Packed %d files, %lu bytes (%lu more compressed) into %s, "
+        "%lu bytes.\n", file_count, (unsigned long) body_bytes,
+        (unsigned long) gzip_bytes, output, (unsigned long) offset);
+
+    for (i = 0; i < file_count; ++i) {
+        free(files[i].body);
+        free(files[i].gzip);
+    }
+    free(files);
+    free(entries);
+    free(strings);
+    return 0;
+}
@@ -1,26 +1,44 @@
+/* web_server.c */
+
+/*
+CHAPTER 7:  Building a Simple Web Server
+
+To execute: gcc web_server.c -o web_server -pthread -lz
+            ./web_server [--workers N]
+
+(Without zlib, build with -DNO_ZLIB and leave out -lz; see COMPRESSION.)
+
+Serves the files in public/ over HTTP on port 8080.
+*/
+
+#define _GNU_SOURCE
 #include "chap07.h"
+#include "../chapter6/http_scan.h"
+#include "histogram.h"
+#include "file_header.h"
+#include "pack.h"
+#include "router.h"
+#include "request_parser.h"
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
 
-const char *get_content_type(const char* path) {
-    const char *last_dot = strrchr(path, '.');
-    if (last_dot) {
-        if (strcmp(last_dot, ".css") == 0) return "text/css";
-        if (strcmp(last_dot, ".csv") == 0) return "text/csv";
-        if (strcmp(last_dot, ".gif") == 0) return "image/gif";
-        if (strcmp(last_dot, ".htm") == 0) return "text/html";
-        if (strcmp(last_dot, ".html") == 0) return "text/html";
-        if (strcmp(last_dot, ".ico") == 0) return "image/x-icon";
-        if (strcmp(last_dot, ".jpeg") == 0) return "image/jpeg";
-        if (strcmp(last_dot, ".jpg") == 0) return "image/jpeg";
-        if (strcmp(last_dot, ".js") == 0) return "application/javascript";
-        if (strcmp(last_dot, ".json") == 0) return "application/json";
-        if (strcmp(last_dot, ".png") == 0) return "image/png";
-        if (strcmp(last_dot, ".pdf") == 0) return "application/pdf";
-        if (strcmp(last_dot, ".svg") == 0) return "image/svg+xml";
-        if (strcmp(last_dot, ".txt") == 0) return "text/plain";
-    }
+/*
+Listening socket options. listen_backlog is how many connections the kernel 
+queues for us before we accept() them; once that queue is full, further 
+connection attempts are dropped and the client only retries after a second 
+or more, so a burst of connections needs a deep queue. (The kernel caps it 
+at net.core.somaxconn.)
 
-    return "application/octet-stream";
-}
+With defer_accept, a connection isn't handed to us until the client has sent 
+some data, so clients that connect and say nothing never cost a wakeup. 
+fastopen_queue enables TCP Fast Open, which lets a returning client send its 
+request along with the SYN, saving a round trip; the value limits how many 
+such connections may be pending at once. Both are off unless asked for.
+*/
+static int listen_backlog = 1024;
+static int defer_accept = 0;
+static int fastopen_queue = 0;
 
 SOCKET create_socket(const char* host, const char* port) {
     printf("Configuring local address...\n");
@@ -43,14 +61,42 @@ SOCKET create_socket(const char* host, const char* port) {
         exit(1);
     }
 
+    /*
+    SO_REUSEADDR lets the server restart straight away, even while old 
+    connections are still in TIME_WAIT. SO_REUSEPORT lets every worker bind 
+    its own socket to the same port; the kernel then balances new 
+    connections between them.
+    */
+    int yes = 1;
+    setsockopt(socket_listen, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (setsockopt(socket_listen, SOL_SOCKET, SO_REUSEPORT, &yes, 
+            sizeof(yes))) {
+        fprintf(stderr, "ERROR: setsockopt() failed. (%d)\n", 
+            GETSOCKETERRNO());
+        exit(1);
+    }
+
     printf("Binding socket to local address...\n");
     if (bind(socket_listen, bind_address->ai_addr, bind_address->ai_addrlen)) {
         fprintf(stderr, "ERROR: bind() failed. (%d)\n", GETSOCKETERRNO());
         exit(1);
     }
 
+    freeaddrinfo(bind_address);
+
+    if (defer_accept && setsockopt(socket_listen, IPPROTO_TCP, 
+            TCP_DEFER_ACCEPT, &defer_accept, sizeof(defer_accept))) {
+        fprintf(stderr, "WARNING: TCP_DEFER_ACCEPT unavailable. (%d)\n", 
+            GETSOCKETERRNO());
+    }
+    if (fastopen_queue && setsockopt(socket_listen, IPPROTO_TCP, 
+            TCP_FASTOPEN, &fastopen_queue, sizeof(fastopen_queue))) {
+        fprintf(stderr, "WARNING: TCP_FASTOPEN unavailable. (%d)\n", 
+            GETSOCKETERRNO());
+    }
+
     printf("Listening...\n");
-    if (listen(socket_listen, 10) < 0) {
+    if (listen(socket_listen, listen_backlog) < 0) {
         fprintf(stderr, "ERROR: listen() failed. (%d)\n", GETSOCKETERRNO());
         exit(1);
     }
@@ -58,352 +104,4457 @@ SOCKET create_socket(const char* host, const char* port) {
     return socket_listen;
 }
 
-#define MAX_REQUEST_SIZE 2047
+/* The longest request path accepted, after percent-decoding. */
+#define MAX_PATH_SIZE 2047
+/* The longest path of a file served from public/: "public" and the above. */
+#define MAX_FILE_PATH_SIZE (6 + MAX_PATH_SIZE)
+
+struct out_chunk;
+
+/*
+A deadline in the timer wheel (see TIMEOUTS below). expires is in ticks, and 
+prev and next link the timer into the list of its wheel slot.
+*/
+struct timer {
+    uint64_t expires;
+    struct timer* prev;
+    struct timer* next;
+    int armed;
+};
+
+enum { TIMER_IDLE, TIMER_HEADER, TIMER_WRITE };
+
+struct ip_entry;
+
+/*
+A request buffer (see REQUEST BUFFERS below): the bytes received so far, 
+with the state of parsing them. capacity is how many bytes data can hold, 
+not counting a null terminator.
+*/
+struct request_buffer {
+    struct http_request parser;
+    int capacity;
+    int size_class;
+    struct request_buffer* next;
+    char data[];
+};
 
 struct client_info {
     socklen_t address_length;
     struct sockaddr_storage address;
+    /* The address as text, formatted once when the client connects. */
+    char address_text[INET6_ADDRSTRLEN];
     SOCKET socket;
-    char request[MAX_REQUEST_SIZE + 1];
+    /* The per-address limits this client counts against (PER-IP LIMITS). */
+    struct ip_entry* ip;
+    /*
+    The request being received, held in a buffer that is only attached while 
+    there is something in it; request points at its data. Both are null 
+    between requests.
+    */
+    struct request_buffer* in;
+    char* request;
     int received;
+    /*
+    The set of epoll events this client is registered for. The epoll_event 
+    handed to the kernel carries a pointer back to this client_info, so a 
+    ready event leads straight to its client without any searching.
+    */
+    uint32_t events;
+    /*
+    HTTP/1.1 connections stay open between requests (keep-alive). 
+    keep_alive says whether this connection stays open after the current 
+    response and requests_served counts the requests answered on it.
+    */
+    int keep_alive;
+    int requests_served;
+    /*
+    Set while answering a HEAD request, whose responses carry the same 
+    header as for GET but no body.
+    */
+    int head_only;
+    /* The status and body size of the last response, for the access log. */
+    int status;
+    size_t body_bytes;
+    /*
+    For the latency histograms (see METRICS below), in microseconds: when 
+    the connection was accepted, and when the response now being sent was 
+    queued (0 if none is). first_byte_sent is set once the first byte of the 
+    first response has gone out.
+    */
+    uint64_t accepted_us;
+    uint64_t response_us;
+    int first_byte_sent;
+    /*
+    The connection's deadline (see TIMEOUTS below) and which kind it is. 
+    request_started is when the request now being received began to arrive, 
+    and last_progress when the client last took some of its response; both 
+    are in milliseconds.
+    */
+    struct timer timer;
+    int timer_kind;
+    uint64_t request_started;
+    uint64_t last_progress;
+    /*
+    Responses waiting to be written (see OUTPUT QUEUE below). closing is set 
+    once a response has been queued that ends the connection; the client is 
+    dropped as soon as that response has been flushed.
+    */
+    struct out_chunk* out_head;
+    struct out_chunk* out_tail;
+    size_t out_bytes;
+    int closing;
+    /*
+    Only used by the io_uring engine (see IO_URING below). recv_armed is set 
+    while a recv is outstanding and chain_left counts the operations of the 
+    current send chain that haven't completed yet; stage is the buffer file 
+    data is read into before being sent. A client dropped while any of those 
+    operations are outstanding is marked dropping, and its memory is only 
+    reused once they have all completed.
+    */
+    int recv_armed;
+    int chain_left;
+    int chain_failed;
+    char* stage;
+    int dropping;
+    /*
+    Clients are kept on a doubly linked list so that any client can be 
+    unlinked in constant time, without walking the list to find the node 
+    that points at it.
+    */
+    struct client_info *prev;
     struct client_info *next;
 
 };
+
+/* Defined with the output queue further down. */
+void clear_queue(struct client_info* client);
+
 /* 
 Having the list of clients be a global variable is fine for a toy program like 
 this, but for a larger application which is re-entrant (that is to say, 
 capable of being interrupted and then resuming again before it finishes 
 executing). In that case, it would be wise to pass the root of the linked list 
-to each function call. */
-static struct client_info* clients;
+to each function call. 
+
+Since every worker thread runs its own event loop (see WORKERS below), this 
+and the other per-loop state are declared __thread: each thread gets its own 
+separate copy of the variable. */
+static __thread struct client_info* clients;
 
 /*
-Simple function to retreive client_info object associated with a specific 
-socket. If there is no appropriate client_info object, a new one is made 
-and added to the client_info linked list.
+METRICS
+
+Latencies are recorded in the histograms of histogram.h. Responses are 
+counted by status code: the codes the server sends are listed in 
+tracked_status, and anything else is counted as "other".
 */
-struct client_info* get_client(SOCKET s) { 
-    struct client_info *ci = clients;
+static const int tracked_status[] = {
+    200, 206, 304, 400, 404, 405, 416, 429, 431
+};
+#define STATUS_KINDS (sizeof(tracked_status) / sizeof(tracked_status[0]) + 1)
 
-    while (ci) {
-        if (ci->socket == s) {
-            break;
-        } else {
-            ci = ci->next;
-        }
-    }
+/*
+The worker that the current thread is running, and the counters it keeps. 
+Only the owning worker ever writes to its worker_stats. Other threads do 
+read them (for /__stats and SIGUSR1), without any locking, so what they see 
+may be a moment out of date, which is fine for statistics. Keeping the 
+counters per worker means recording never has to wait on another thread; 
+they are only added up when someone asks for them.
+
+first_byte is the time from accepting a connection to sending the first 
+byte of its first response, and response the time from a request being 
+parsed to the last byte of its response being sent. accept_batch counts how 
+many connections were accepted each time the listener woke the worker.
+*/
+struct worker_stats {
+    unsigned long accepts;
+    unsigned long rejected;
+    unsigned long limited;
+    unsigned long requests;
+    unsigned long bytes_sent;
+    unsigned long log_dropped;
+    unsigned long responses[STATUS_KINDS];
+    int active;
+    /* Bytes of request buffers attached to clients right now. */
+    long buffer_bytes;
+    int pool_high_water;
+    struct histogram first_byte;
+    struct histogram response;
+    struct histogram accept_batch;
+};
+
+/*
+A worker's ring buffer of access log records (see ACCESS LOG below). head 
+and tail are kept on separate cache lines, since they are written by 
+different threads.
+*/
+#define LOG_RING_SIZE (1024 * 1024)
+
+struct log_ring {
+    char* data;
+    /* Written only by the worker. */
+    uint64_t tail __attribute__((aligned(64)));
+    /* Written only by the log thread. */
+    uint64_t head __attribute__((aligned(64)));
+};
+
+struct worker {
+    int id;
+    pthread_t thread;
+    struct worker_stats stats;
+    struct log_ring log;
+};
+
+static __thread struct worker* self;
+static struct worker* workers;
+static int worker_count = 1;
+
+/* Print a line about every connection opened, closed or timed out. */
+static int verbose = 0;
+
+/*
+Keep-alive limits. A connection is closed after idle_timeout seconds without 
+any data from the client, or once it has made max_requests requests.
+*/
+static int idle_timeout = 5;
+static int max_requests = 100;
+
+/*
+Socket descriptors are small integers handed out lowest-first by the kernel, 
+so they make a good index into a plain array. client_table[s] holds the 
+client using socket s (or null), which turns a lookup into a single array 
+access instead of a walk over every connected client. The table is grown by 
+doubling whenever a socket number falls past its end.
+*/
+static __thread struct client_info** client_table;
+static __thread int client_table_size;
 
-    if (ci) return ci;
-    struct client_info *n = (struct client_info*) calloc (1, sizeof(struct client_info));
+/*
+Rather than calling calloc() and free() for every connection, client_info 
+objects come from a pool that is allocated once at startup. The objects sit 
+next to each other in one block of memory, and the unused ones are chained 
+together through their next pointers to form a free list. Taking an object 
+or giving one back is just a pointer swap, so accepting and closing 
+connections never touches the heap and the heap never fragments.
+
+The pool's capacity is the maximum number of simultaneous clients. 
+high_water records the most clients ever in use at once, which is useful for 
+deciding how large the pool really needs to be.
+*/
+struct client_pool {
+    struct client_info* slots;
+    struct client_info* free_list;
+    int capacity;
+    int in_use;
+    int high_water;
+};
+static __thread struct client_pool pool;
 
-    if (!n) {
+void pool_init(int capacity) {
+    pool.slots = (struct client_info*) calloc(capacity, 
+        sizeof(struct client_info));
+    if (!pool.slots) {
         fprintf(stderr, "ERROR: Out of memory.\n");
         exit(1);
     }
 
+    /* Chain the slots together in order so the first ones are used first. */
+    int i;
+    for (i = 0; i < capacity - 1; ++i) {
+        pool.slots[i].next = &pool.slots[i + 1];
+    }
+    pool.slots[capacity - 1].next = 0;
+
+    pool.free_list = pool.slots;
+    pool.capacity = capacity;
+    pool.in_use = 0;
+    pool.high_water = 0;
+}
+
+/* Returns a zeroed client_info, or null if every slot is in use. */
+struct client_info* pool_alloc() {
+    struct client_info* ci = pool.free_list;
+    if (!ci) return 0;
+
+    pool.free_list = ci->next;
+    memset(ci, 0, sizeof(*ci));
+
+    /* Published as it changes, like active, so /__stats can show it. */
+    if (++pool.in_use > pool.high_water) {
+        pool.high_water = pool.in_use;
+        self->stats.pool_high_water = pool.high_water;
+    }
+    self->stats.active = pool.in_use;
+    return ci;
+}
+
+void pool_free(struct client_info* ci) {
+    ci->next = pool.free_list;
+    pool.free_list = ci;
+    --pool.in_use;
+    self->stats.active = pool.in_use;
+}
+
+static void register_client_socket(struct client_info* ci) {
+    if (ci->socket >= client_table_size) {
+        int size = client_table_size ? client_table_size : 1024;
+        while (size <= ci->socket) size *= 2;
+
+        struct client_info** t = (struct client_info**) realloc(client_table, 
+            size * sizeof(*t));
+        if (!t) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(1);
+        }
+        memset(t + client_table_size, 0, 
+            (size - client_table_size) * sizeof(*t));
+        client_table = t;
+        client_table_size = size;
+    }
+    client_table[ci->socket] = ci;
+}
+
+/*
+Simple function to retreive client_info object associated with a specific 
+socket. If there is no appropriate client_info object, a new one is taken 
+from the pool for that socket and added to the client_info linked list. 
+Returns null if the pool is exhausted.
+*/
+struct client_info* get_client(SOCKET s) { 
+    if (ISVALIDSOCKET(s) && s < client_table_size && client_table[s]) {
+        return client_table[s];
+    }
+
+    struct client_info *n = pool_alloc();
+    if (!n) return 0;
+
     /*
-    The accept() function, which we will use later, requires the maximum 
-    address length as one of its inputs--we set it here so we can use it 
-    easily later.
+    The accept() function requires the maximum address length as one of its 
+    inputs--we set it here so it is always valid.
 
     Also note that new data is added to the beginning of the list, not to 
     the end!
     */
     n->address_length = sizeof(n->address);
+    n->socket = s;
+    n->prev = 0;
     n->next = clients;
+    if (clients) clients->prev = n;
     clients = n;
+
+    if (ISVALIDSOCKET(s)) register_client_socket(n);
     return n;
 }
 
+void timer_cancel(struct timer* t);
+void ip_release(struct ip_entry* e);
+void request_release(struct client_info* client);
+
 /*
 Removes a given client.
 */
 void drop_client(struct client_info* client) {
-    /* Closes the connection first. */
-    CLOSESOCKET(client->socket);
+    if (!client->dropping) {
+        client->dropping = 1;
 
-    struct client_info **p = &clients;
+        if (ISVALIDSOCKET(client->socket) && 
+            client->socket < client_table_size) {
+            client_table[client->socket] = 0;
+        }
 
-    while (*p) {
-        /* Walk the linked list. */
-        if (*p == clients) {
-            *p = client->next;
-            free(client);
-            return;
+        /* Unlink from the neighbours directly; no walking required. */
+        if (client->prev) {
+            client->prev->next = client->next;
+        } else {
+            clients = client->next;
         }
-        p = &(*p)->next;
+        if (client->next) client->next->prev = client->prev;
+
+        timer_cancel(&client->timer);
+        ip_release(client->ip);
+    }
+
+    /*
+    With io_uring the kernel may still be using this client's buffers. 
+    Shutting the socket down makes those operations finish, and the io_uring 
+    engine calls drop_client() again once the last one has completed.
+    */
+    if (client->recv_armed || client->chain_left) {
+        shutdown(client->socket, SHUT_RDWR);
+        return;
     }
 
-    fprintf(stderr, "ERROR: drop_client() client not found.\n");
-    exit(1);
+    /* Throw away anything that was still waiting to be sent or parsed. */
+    clear_queue(client);
+    client->received = 0;
+    request_release(client);
+    free(client->stage);
+
+    if (ISVALIDSOCKET(client->socket)) CLOSESOCKET(client->socket);
+
+    pool_free(client);
 }
 
 const char *get_client_address(struct client_info* ci) {
-    /* 
-    Note that this buffer is declared static--this is to ensure that its 
-    memory will be available after the function returns, and saves us from 
-    having to worry about using free()
-    */
-    static char address_buffer[100];
-    getnameinfo((struct sockaddr*) &ci->address, ci->address_length, 
-        address_buffer, sizeof(address_buffer), 0, 0, NI_NUMERICHOST);
-
-    return address_buffer;
+    return ci->address_text;
 }
 
-/* Wait for data from clients. */
-fd_set wait_on_clients(SOCKET server) {
-    /* Declare and zero a set of sockets. */
-    fd_set reads;
-    FD_ZERO(&reads);
-    FD_SET(server, &reads);
-    SOCKET max_socket = server;
+/*
+Sockets are put in non-blocking mode so that recv(), send() and accept() 
+return EAGAIN (or EWOULDBLOCK) instead of stalling the whole server. This is 
+required for edge-triggered epoll, where we must keep reading until the 
+socket is drained.
+*/
+int set_nonblocking(SOCKET s) {
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(s, F_SETFL, flags | O_NONBLOCK);
+}
 
-    struct client_info* ci = clients;
+/*
+Registers a client with the epoll instance. EPOLLET makes the registration 
+edge-triggered: the kernel only reports a socket when new data arrives, 
+rather than on every call while data is pending, so we are responsible for 
+draining it ourselves. EPOLLOUT likewise reports each time the socket's send 
+buffer goes from full to having room again, which is when queued output can 
+continue. Since both are edge-triggered, the registration never has to be 
+changed with EPOLL_CTL_MOD.
+*/
+int watch_client(int epfd, struct client_info* client) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    client->events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.events = client->events;
+    ev.data.ptr = client;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, client->socket, &ev);
+}
 
-    /* Find max socket value, necessary for select(). */
-    while (ci) {
-        FD_SET(ci->socket, &reads);
-        if (ci->socket > max_socket) {
-            max_socket = ci->socket;
-        }
-        ci = ci->next;
-    }
+/* 
+Wait for data from clients. 
 
-    if (select(max_socket, &reads, 0, 0, 0) < 0) {
-        fprintf(stderr, "ERRROR: Issue with select() (%d)\n", GETSOCKETERRNO());
+The previous select() version rebuilt an fd_set from the entire client list on 
+every call and then walked the list again with FD_ISSET(). epoll keeps the 
+set of watched sockets inside the kernel, so this only returns the sockets 
+that are actually ready and the cost no longer grows with the number of 
+connected clients. It is also not limited to FD_SETSIZE (1024) sockets.
+*/
+int wait_on_clients(int epfd, struct epoll_event* events, int max_events, 
+        int timeout_ms) {
+    int n = epoll_wait(epfd, events, max_events, timeout_ms);
+    if (n < 0 && GETSOCKETERRNO() != EINTR) {
+        fprintf(stderr, "ERROR: Issue with epoll_wait() (%d)\n", 
+            GETSOCKETERRNO());
     }
-    return reads;
+    return n;
 }
 
 /*
-If the client has sent an HTTP request that the server does not understand, 
-this function which neatly encapsulates the error behaviour is called.
+TIMEOUTS
+
+Every connection is subject to one of three deadlines, depending on what it 
+is doing:
+
+  * idle: a keep-alive connection with nothing buffered and nothing to send 
+    is closed after idle_timeout seconds without hearing from the client.
+  * header: once a request has started to arrive, all of its header must 
+    arrive within header_timeout seconds. Further bytes don't extend this, 
+    so a client can't hold a connection open forever by sending its 
+    request one byte at a time (a "slowloris" attack).
+  * write: while a response is queued, the client must take some of it at 
+    least every write_timeout seconds.
+
+The deadlines are kept in a hierarchical timer wheel. Level 0 is an array of 
+WHEEL_SLOTS lists, one for each of the next WHEEL_SLOTS ticks, and a timer 
+due within that time sits in the slot for its tick. Each level above covers 
+WHEEL_SLOTS times as much time with slots WHEEL_SLOTS times as wide. When the 
+wheel's time reaches the start of a higher level slot, the timers in it are 
+"cascaded": put back into the wheel, which now places them in a lower level. 
+Timers are doubly linked into their slot, so arming or cancelling one takes 
+constant time however many there are, and expiring them never involves 
+looking at clients whose deadline is still in the future.
+
+The event loop sleeps until the start of the nearest non-empty slot, found 
+by looking through at most WHEEL_SLOTS slots per level.
 */
-void send_400(struct client_info* client) {
-    const char* c400 = "HTTP/1.1 400 Bad Request\r\n"
-        "Connection: close\r\n"
-        "Content-Length: 11\r\n\r\nBad Request";
+#define TICK_MS 10
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
 
-    send(client->socket, c400, strlen(c400), 0);
-    drop_client(client);
-}
+struct timer_wheel {
+    /* The last tick that has been processed. */
+    uint64_t now;
+    int count;
+    /* Each slot is a circular list whose head is never itself a timer. */
+    struct timer slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+static __thread struct timer_wheel wheel;
 
-void send_404(struct client_info* client) {
-    const char* c404 = "HTTP/1.1 404 Not Found\r\n"
-        "Connection: close\r\n"
-        "Content-Length: 9\r\n\r\nNot Found";
+/*
+The time at which the event loop last woke up, in milliseconds. Everything 
+that happens during one pass of the loop is treated as happening then.
+*/
+static __thread uint64_t loop_ms;
 
-    send(client->socket, c404, strlen(c404), 0);
-    drop_client(client);
-}
+static int header_timeout = 10;
+static int write_timeout = 10;
 
-void serve_resource(struct client_info* client, const char* path) {
-    /* Printed for debugging purposes. */
-    printf("Serving resource %s to %s\n", path, get_client_address(client));
+/* Milliseconds from a monotonic clock. */
+uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    /* Serve a default file if the client requests "/" */
-    if (strcmp(path, "/") == 0) path = "/index.html";
+/* The same in microseconds, for measuring latency. */
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    /* Check that the path isn't too long. */
-    if (strlen(path) > 100){
-        send_400(client);
-        return;
+void wheel_init() {
+    int level, slot;
+    for (level = 0; level < WHEEL_LEVELS; ++level) {
+        for (slot = 0; slot < WHEEL_SLOTS; ++slot) {
+            struct timer* head = &wheel.slots[level][slot];
+            head->prev = head->next = head;
+        }
     }
+    loop_ms = now_ms();
+    wheel.now = loop_ms / TICK_MS;
+    wheel.count = 0;
+}
 
-    /* Check for double dots ".." to avoid access of forbidden resources. */
-    if (strcmp(path, "..")) {
-        send_404(client);
-        return;
+void timer_cancel(struct timer* t) {
+    if (!t->armed) return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->armed = 0;
+    --wheel.count;
+}
+
+/* Links t into the slot for t->expires, which is after wheel.now. */
+static void wheel_insert(struct timer* t) {
+    uint64_t delta = t->expires - wheel.now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && 
+        delta >= (uint64_t) 1 << (WHEEL_BITS * (level + 1))) {
+        ++level;
+    }
+    /* Anything beyond the top level waits in its furthest slot. */
+    if (delta >= (uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) {
+        t->expires = wheel.now + 
+            ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
     }
 
-    /* Full path to the resource. */
-    char full_path[128];
-    sprintf(full_path, "public%s", path);
+    struct timer* head = &wheel.slots[level]
+        [(t->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+    t->armed = 1;
+    ++wheel.count;
+}
 
-    /*
-    Unix based systems use slashes ("/") to separate directories, while 
-    Windows based systems use a backslash ("\"). Here, we walk the path string 
-    and replace the slashes appropriately. Note that a double backslash is 
-    used in this code, since C interprets the first backslash as escaping the 
-    second backslash.
+/* Arms t to expire at deadline (in milliseconds), replacing any earlier. */
+void timer_arm(struct timer* t, uint64_t deadline) {
+    uint64_t expires = (deadline + TICK_MS - 1) / TICK_MS;
+    if (expires <= wheel.now) expires = wheel.now + 1;
+    if (t->armed && t->expires == expires) return;
 
-    Many Windows functions handle this automatically, but we do it manually 
-    for peace of mind.
-     */
-#if defined(_WIN32)
-    char *p = full_path;
-    while (*p) {
-        if (p == '/') *p = '\\';
-        ++p;
+    timer_cancel(t);
+    t->expires = expires;
+    wheel_insert(t);
+}
+
+/*
+Moves the wheel forward to the current time, calling expire() for every 
+timer that has come due. Timers are taken off their slot one at a time, so 
+expire() is free to arm or cancel any timer, including others in the slot.
+*/
+void wheel_advance(void (*expire)(struct timer*)) {
+    uint64_t target = loop_ms / TICK_MS;
+
+    while (wheel.now < target) {
+        /* Nothing can expire, so there's no need to step through. */
+        if (!wheel.count) {
+            wheel.now = target;
+            break;
+        }
+        uint64_t tick = ++wheel.now;
+
+        /*
+        At the start of a level's slot, cascade it, starting from the 
+        highest level so that timers can move down more than one level.
+        */
+        int level = 1;
+        while (level < WHEEL_LEVELS && 
+            !(tick & (((uint64_t) 1 << (WHEEL_BITS * level)) - 1))) {
+            ++level;
+        }
+        while (--level > 0) {
+            struct timer* head = &wheel.slots[level]
+                [(tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+            struct timer* t = head->next;
+            head->prev = head->next = head;
+            while (t != head) {
+                struct timer* next = t->next;
+                --wheel.count;
+                wheel_insert(t);
+                t = next;
+            }
+        }
+
+        struct timer* head = &wheel.slots[0][tick & (WHEEL_SLOTS - 1)];
+        while (head->next != head) {
+            struct timer* t = head->next;
+            timer_cancel(t);
+            expire(t);
+        }
     }
-#endif
+}
 
-    FILE *fp = fopen(full_path, "rb");
+/*
+Returns how many milliseconds the event loop may sleep before the next 
+timer needs attention, or -1 if no timers are armed.
+*/
+int wheel_timeout() {
+    if (!wheel.count) return -1;
 
-    if (!fp) {
-        fprintf(stderr, "ERROR: Issue accessing resource.\n");
-        send_404(client);
-        return;
+    uint64_t next = (uint64_t) -1;
+    int level;
+    for (level = 0; level < WHEEL_LEVELS; ++level) {
+        int shift = WHEEL_BITS * level;
+        uint64_t i;
+        for (i = 1; i <= WHEEL_SLOTS; ++i) {
+            uint64_t tick = ((wheel.now >> shift) + i) << shift;
+            struct timer* head = 
+                &wheel.slots[level][(tick >> shift) & (WHEEL_SLOTS - 1)];
+            if (head->next != head) {
+                if (tick < next) next = tick;
+                break;
+            }
+        }
     }
 
-    /*
-    Determine the size of the requested file. fseek() is used to set the file 
-    position indicator to 0 bits after SEEK_END. Note that 0L is used, which 
-    indicates a long integer, but with the value of 0. 
+    int64_t ms = (int64_t) (next * TICK_MS) - (int64_t) loop_ms;
+    return ms < 0 ? 0 : (int) ms;
+}
 
-    ftell() is used to obtain the current value of the file position indicator 
-    for file fp, and then rewind() is used to reset it to 0.
-    */
-    fseek(fp, 0L, SEEK_END);
-    size_t cl = ftell(fp);
-    rewind(fp);
+/*
+Arms the client's timer for whichever deadline applies to it now. Called 
+whenever something has happened on the connection.
+*/
+void update_timer(struct client_info* client) {
+    uint64_t deadline;
 
-    const char* ct = get_content_type(full_path);
+    if (client->out_bytes) {
+        /* Progress is recorded by retire_sent() as the queue drains. */
+        if (client->timer_kind != TIMER_WRITE) {
+            client->timer_kind = TIMER_WRITE;
+            client->last_progress = loop_ms;
+        }
+        deadline = client->last_progress + write_timeout * 1000;
+    } else if (client->received) {
+        /* handle_request() clears request_started after each request. */
+        if (!client->request_started) client->request_started = loop_ms;
+        client->timer_kind = TIMER_HEADER;
+        deadline = client->request_started + header_timeout * 1000;
+    } else {
+        client->timer_kind = TIMER_IDLE;
+        deadline = loop_ms + idle_timeout * 1000;
+    }
 
-    /* Temporary buffer to store header fields. */
-# define BSIZE 1024
-    char buffer[BSIZE];
+    timer_arm(&client->timer, deadline);
+}
 
-    /* Note the final send is only /r/n to delinate the header and body. */
-    sprintf(buffer, "HTTP/1.1 200 OK/r/n");
-    send(client->socket, buffer, strlen(buffer), 0);
-    sprintf(buffer, "Connection: close/r/n");
-    send(client->socket, buffer, strlen(buffer), 0);
-    sprintf(buffer, "Content-Length: %lu/r/n", cl);
-    send(client->socket, buffer, strlen(buffer), 0);
-    sprintf(buffer, "Content-Type: %sr/n", ct);
-    send(client->socket, buffer, strlen(buffer), 0);
-    sprintf(buffer, "/r/n");
-    send(client->socket, buffer, strlen(buffer), 0);
+void client_timed_out(struct timer* t) {
+    struct client_info* client = (struct client_info*) 
+        ((char*) t - offsetof(struct client_info, timer));
 
-    /*
-    Fill up the buffer using fread(), then enter a loop where data is sent 
-    with send() and read with fread() until all data is exhausted and there is 
-    nothing more to be read from the buffer.
-    */
-    int r = fread(buffer, 1, BSIZE, fp);
-    while (r) {
-        send(client->socket, buffer, r, 0);
-        r = fread(buffer, 1, BSIZE, fp);
+    if (client->timer_kind == TIMER_WRITE) {
+        if (verbose) printf("Client %s stopped reading; closing.\n", 
+            get_client_address(client));
+    } else if (client->timer_kind == TIMER_HEADER) {
+        if (verbose) printf("Request from %s timed out; closing.\n", 
+            get_client_address(client));
+    } else {
+        if (verbose) printf("Closing idle connection from %s.\n", 
+            get_client_address(client));
     }
-
-    fclose(fp);
     drop_client(client);
 }
 
-int main(int argc, char* argv[]) {
-#if defined(_WIN32)
-    WSADATA d;
-    i (WSAStartup(MAKEWORD(2, 2), &d)) {
-        fprintf(stderr, "ERROR: Issue with Windows initialization.\n");
-        return1;
-    }
-#endif
+/*
+PER-IP LIMITS
 
-    /* Create listening socket at port 8080 */
-    SOCKET server = create_socket(0, "8080");
+Each client address may hold at most max_per_ip connections at once 
+(--max-per-ip), and its requests may be rate limited with a token bucket 
+(--rate and --burst): the bucket holds up to ip_burst tokens and refills at 
+ip_rate tokens a second, and every request takes one. A client whose bucket 
+is empty can't connect, and a request arriving on an open connection when 
+the bucket is empty is answered with 429 Too Many Requests. Both limits are 
+off unless asked for, and then the table below isn't used at all.
 
-    /* Note that this loop has no termination and listens forever. */
-    while (1) {
-        fd_set reads;
-        wait_on_clients(server);
+The limits are checked straight after accept(), before a client_info is 
+even allocated, so turning away an over-limit client costs very little.
 
-        /*
-        If server is in the fd_set reads, this indicates an incoming client 
-        connection. 
-        */
-        if(FD_ISSET(server, &reads)) {
-            /* Invalid socket number makes get_client() create a new socket. */
-            struct client_info* client = get_client(-1);
-
-            /* Populate fields of client and accept the connection. */
-            client->socket = accept(server, (struct sockaddr*) 
-                &client->address, 
-                    &client->address_length);
-
-            if (!ISVALIDSOCKET(client->socket)) {
-                fprintf(stderr, "ERROR: Issue with accept(). (%d)\n", 
-                    GETSOCKETERRNO());
-                return 1;
-            }
-            printf("New connection from %s\n", get_client_address(client));
-        }
+The state is kept per address in a compact hash table. Addresses hash to a 
+bucket of IP_BUCKET_SLOTS entries, which is searched in full; there are no 
+chains to follow and nothing is ever allocated. The hash is seeded at random 
+so that nobody can pick addresses that all land in the same bucket.
 
-        /*
-        If an already connected client is sending data, walk the linked list 
-        of clients and use FD_ISSET to determine which clients have data 
-        available to read.
-        */
-        struct client_info* client = clients;
-        while(client) {
-            struct client_info* next= client->next;
-            if (FD_ISSET(client->socket, &reads)) {
-                /*
-                Check if there is still memory available in the received 
-                buffer of the client.
-                */
-                if (MAX_REQUEST_SIZE == client->received) {
-                    send_400(client);
-                    continue;
-                }
-                /* 
-                Receive data. 
-
-                TODO: How does "client->request + client->received" work as a
-                buffer? Look into this later
-                */
-                int r = recv(client->socket, 
-                    client->request + client->received, 
-                    MAX_REQUEST_SIZE - client->received, 0);
-
-                /*
-                Sudden client disconnects warrant memory cleanup. Successful 
-                data writes are finalized with a null terminator added 
-                to the end of that client's data buffer.
-                */
-                if (r < 1) {
-                    printf("Unexpected disconnect from %s.\n", 
-                        get_client_address(client));
-                    drop_client(client);
-                } else {
-                    client->received += r;
-                    client->request[client->received] = 0;
-
-                    /*
-                    If \r\n\r\n is found, the HTTP header has been received 
-                    and can now be parsed.
-                    */
-                    char *q = strstr(client->request, "\r\n\r\n");
-                    if (q) {
-                        /* Enforce that valid paths start with a slash. */
-                        if (strncmp("GET /", client->request, 5)) {
-                            send_400(client);
-                        } else {
-                            /* Set the start of the path to after "/GET" */
-                            char* path = client->request + 4;
-                            char* end_path = strstr(path, " ");
-                            /* Next space indicates end of path. */
-                            if (!end_path) {
-                                send_400(client); 
-                            } else {
-                                *end_path = 0;
-                                serve_resource(client, path);
-                            }
-                        }
-                    }
-                }
-            }
-            client = next;
-        }
-    }
+Entries aren't removed when their last connection closes. Instead an entry 
+with no connections whose token bucket has filled up again carries no 
+information, so it counts as free and is simply overwritten. Any other entry 
+is never handed to a new address: that would forget the connections and 
+requests the old address is being held to, and give it a fresh allowance 
+the next time it came back. So if a bucket has no free entries, the new 
+client is turned away as though it were over its limits. The table stays 
+the same size however many different addresses connect, and an address 
+that can't be tracked can't get around the limits either.
 
-    printf("Closing socket...\n");
-    CLOSESOCKET(server);
+Like everything else, the table belongs to one worker, so the limits apply 
+per worker: with --workers N, an address may hold up to N times max_per_ip 
+connections, spread between the workers by the kernel.
+*/
+#define IP_BUCKET_SLOTS 8
 
-# if defined(_WIN32)
-    WSACleanup();
-#endif 
-    printf("Finished.\n");
-    return(0);
-}
\ No newline at end of file
+struct ip_entry {
+    /* IPv4 addresses are stored as IPv4-mapped IPv6 addresses. */
+    unsigned char address[16];
+    int used;
+    int connections;
+    /* Thousandths of a token, refilled as of the time in refilled. */
+    uint32_t tokens;
+    uint64_t refilled;
+};
+
+struct ip_table {
+    struct ip_entry* entries;
+    unsigned bucket_mask;
+    uint32_t seed;
+};
+static __thread struct ip_table ip_table;
+
+static int max_per_ip = 0;
+static int ip_rate = 0;
+static int ip_burst = 0;
+
+void ip_table_init(int max_clients) {
+    /* Room for twice as many addresses as there can be clients. */
+    unsigned buckets = 8;
+    while (buckets * IP_BUCKET_SLOTS < (unsigned) max_clients * 2) {
+        buckets *= 2;
+    }
+    ip_table.entries = (struct ip_entry*) calloc(buckets * IP_BUCKET_SLOTS, 
+        sizeof(struct ip_entry));
+    if (!ip_table.entries) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    ip_table.bucket_mask = buckets - 1;
+    if (getrandom(&ip_table.seed, sizeof(ip_table.seed), 0) != 
+            sizeof(ip_table.seed)) {
+        ip_table.seed = (uint32_t) now_ms() ^ (uint32_t) getpid();
+    }
+}
+
+/* Brings the entry's token bucket up to date. */
+static void ip_refill(struct ip_entry* e) {
+    uint32_t full = ip_burst * 1000;
+    if (e->tokens < full) {
+        /* ip_rate tokens a second is ip_rate thousandths a millisecond. */
+        uint64_t gained = (loop_ms - e->refilled) * ip_rate;
+        e->tokens = gained >= full - e->tokens ? full : e->tokens + gained;
+    }
+    e->refilled = loop_ms;
+}
+
+static int ip_is_free(struct ip_entry* e) {
+    if (!e->used) return 1;
+    if (e->connections) return 0;
+    if (!ip_rate) return 1;
+    ip_refill(e);
+    return e->tokens == (uint32_t) ip_burst * 1000;
+}
+
+/*
+Finds or makes the entry for address, or returns 0 if its bucket has no 
+free entry to make one in.
+*/
+struct ip_entry* ip_lookup(const struct sockaddr_storage* address) {
+    unsigned char key[16];
+    memset(key, 0, sizeof(key));
+    if (address->ss_family == AF_INET6) {
+        memcpy(key, &((struct sockaddr_in6*) address)->sin6_addr, 16);
+    } else {
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, &((struct sockaddr_in*) address)->sin_addr, 4);
+    }
+
+    /* FNV-1a, starting from the random seed. */
+    uint32_t hash = 2166136261u ^ ip_table.seed;
+    int i;
+    for (i = 0; i < 16; ++i) {
+        hash ^= key[i];
+        hash *= 16777619u;
+    }
+    struct ip_entry* bucket = ip_table.entries + 
+        (hash & ip_table.bucket_mask) * IP_BUCKET_SLOTS;
+
+    struct ip_entry* e = 0;
+    for (i = 0; i < IP_BUCKET_SLOTS; ++i) {
+        if (bucket[i].used && memcmp(bucket[i].address, key, 16) == 0) {
+            return &bucket[i];
+        }
+        if (!e && ip_is_free(&bucket[i])) e = &bucket[i];
+    }
+
+    if (!e) return 0;
+    memcpy(e->address, key, 16);
+    e->used = 1;
+    e->connections = 0;
+    e->tokens = ip_burst * 1000;
+    e->refilled = loop_ms;
+    return e;
+}
+
+/*
+Decides whether a connection from address may be accepted, and if so counts 
+it against the address, whose entry is returned.
+*/
+struct ip_entry* ip_admit(const struct sockaddr_storage* address) {
+    struct ip_entry* e = ip_lookup(address);
+    if (!e) return 0;
+
+    if (max_per_ip && e->connections >= max_per_ip) return 0;
+    if (ip_rate) {
+        ip_refill(e);
+        if (e->tokens < 1000) return 0;
+    }
+
+    ++e->connections;
+    return e;
+}
+
+/* Takes a token for a request. Returns 0 if the bucket is empty. */
+int ip_take_token(struct ip_entry* e) {
+    if (!ip_rate || !e) return 1;
+    ip_refill(e);
+    if (e->tokens < 1000) return 0;
+    e->tokens -= 1000;
+    return 1;
+}
+
+void ip_release(struct ip_entry* e) {
+    if (!e) return;
+    --e->connections;
+}
+
+/*
+Creates the client for a socket that has just been accepted from address, 
+unless a limit says no, in which case the socket is closed and 0 returned.
+*/
+struct client_info* admit_client(SOCKET s, 
+        const struct sockaddr_storage* address, socklen_t address_length) {
+    /* With no per-IP limits there is nothing to look up or count. */
+    struct ip_entry* ip = 0;
+    if (max_per_ip || ip_rate) {
+        ip = ip_admit(address);
+        if (!ip) {
+            ++self->stats.limited;
+            CLOSESOCKET(s);
+            return 0;
+        }
+    }
+
+    /* A freshly accepted socket has no client yet, so get_client() creates 
+    and registers one. */
+    struct client_info* client = get_client(s);
+    if (!client) {
+        fprintf(stderr, "ERROR: Client limit reached, "
+            "rejecting connection.\n");
+        ++self->stats.rejected;
+        ip_release(ip);
+        CLOSESOCKET(s);
+        return 0;
+    }
+    ++self->stats.accepts;
+
+    client->accepted_us = now_us();
+    client->ip = ip;
+    memcpy(&client->address, address, address_length);
+    client->address_length = address_length;
+
+    /*
+    Format the address once, here, rather than every time it's printed. 
+    inet_ntop() only converts the numeric address, so unlike getnameinfo() 
+    it never has a reason to go near DNS.
+    */
+    if (address->ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6*) address)->sin6_addr, 
+            client->address_text, sizeof(client->address_text));
+    } else {
+        inet_ntop(AF_INET, &((struct sockaddr_in*) address)->sin_addr, 
+            client->address_text, sizeof(client->address_text));
+    }
+    if (verbose) {
+        printf("New connection from %s\n", get_client_address(client));
+    }
+    return client;
+}
+
+/*
+FILE CACHE
+
+Reading public/ from disk on every request means an fopen(), a size lookup 
+and a read for the same few hot files over and over. Instead, file contents 
+are kept in memory, keyed by their normalized path ("public/index.html"). 
+Small files are copied onto the heap; larger ones are mapped with mmap() so 
+the kernel's page cache backs them without a second copy. Each entry also 
+keeps its Content-Length and Content-Type header lines, formatted once when 
+the file is loaded.
+
+Entries live in a hash table for lookups and on a doubly linked LRU list 
+(most recently used at the head). When the cache grows past its byte budget, 
+entries are evicted from the tail of that list.
+
+To notice files changing without calling stat() on every hit, the directory 
+of each cached file is watched with inotify. The inotify descriptor is 
+registered with epoll like any socket, and a change to a watched file simply 
+throws its entry away. If inotify is unavailable, entries fall back to 
+checking the file's mtime at most once per CACHE_RECHECK_SECONDS.
+*/
+#define CACHE_BUCKETS 1024
+#define CACHE_MMAP_THRESHOLD (64 * 1024)
+#define CACHE_RECHECK_SECONDS 1
+#define CACHE_MAX_WATCHES 256
+
+/*
+How an entry's data is encoded. Besides a file itself, the cache holds 
+compressed variants of it (see COMPRESSION), under the same path.
+*/
+enum { ENCODING_IDENTITY, ENCODING_GZIP, ENCODING_DEFLATE, ENCODINGS };
+static const char* encoding_names[ENCODINGS] = { 0, "gzip", "deflate" };
+
+struct cached_file {
+    /*
+    Kept just after the entry, in the same allocation, since paths can be 
+    long. The files of a pack don't have one.
+    */
+    char* path;
+    unsigned int hash;
+    /* ENCODING_IDENTITY for the file itself, or a compressed variant. */
+    int encoding;
+    char* data;
+    size_t size;
+    int mapped;
+    const char* content_type;
+    /* The header lines every response with this file's body carries. */
+    char header[256];
+    int header_length;
+    char etag[64];
+    time_t mtime;
+    time_t checked;
+    /*
+    Number of queued responses still sending this entry's data. An entry 
+    that is evicted while refs is non-zero is only marked evicted, and its 
+    memory is released by the last cache_release().
+    */
+    int refs;
+    int evicted;
+    /*
+    Set for the files of a pack (see PACKS), which are neither in the cache 
+    nor reference counted, along with the file's packed gzip body, if any.
+    */
+    int packed;
+    struct cached_file* packed_gzip;
+    struct cached_file* hash_next;
+    struct cached_file* lru_prev;
+    struct cached_file* lru_next;
+};
+
+struct watched_dir {
+    int wd;
+    /* Allocated, since there are many watches and paths can be long. */
+    char* dir;
+};
+
+struct file_cache {
+    struct cached_file* buckets[CACHE_BUCKETS];
+    struct cached_file* lru_head;
+    struct cached_file* lru_tail;
+    size_t bytes;
+    size_t budget;
+    int inotify_fd;
+    struct watched_dir watches[CACHE_MAX_WATCHES];
+    int watch_count;
+};
+static __thread struct file_cache cache;
+
+/* FNV-1a, a small and fast string hash. */
+unsigned int hash_path(const char* s) {
+    unsigned int h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+Copies a path while collapsing runs of slashes, so that "public//a.html" and 
+"public/a.html" share one cache entry.
+*/
+void normalize_path(char* out, const char* in) {
+    char prev = 0;
+    while (*in) {
+        if (*in != '/' || prev != '/') *out++ = *in;
+        prev = *in++;
+    }
+    *out = 0;
+}
+
+void cache_init(size_t budget) {
+    memset(&cache, 0, sizeof(cache));
+    cache.budget = budget;
+    cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache.inotify_fd < 0) {
+        fprintf(stderr, "WARNING: inotify unavailable, file cache will "
+            "check modification times instead. (%d)\n", errno);
+    }
+}
+
+static void lru_unlink(struct cached_file* f) {
+    if (f->lru_prev) f->lru_prev->lru_next = f->lru_next;
+    else cache.lru_head = f->lru_next;
+    if (f->lru_next) f->lru_next->lru_prev = f->lru_prev;
+    else cache.lru_tail = f->lru_prev;
+    f->lru_prev = f->lru_next = 0;
+}
+
+static void lru_push_front(struct cached_file* f) {
+    f->lru_prev = 0;
+    f->lru_next = cache.lru_head;
+    if (cache.lru_head) cache.lru_head->lru_prev = f;
+    cache.lru_head = f;
+    if (!cache.lru_tail) cache.lru_tail = f;
+}
+
+static void cache_free(struct cached_file* f) {
+    if (f->mapped) munmap(f->data, f->size);
+    else free(f->data);
+    free(f);
+}
+
+void cache_remove(struct cached_file* f) {
+    struct cached_file** p = &cache.buckets[f->hash % CACHE_BUCKETS];
+    while (*p != f) p = &(*p)->hash_next;
+    *p = f->hash_next;
+
+    lru_unlink(f);
+    cache.bytes -= f->size;
+
+    if (f->refs) f->evicted = 1;
+    else cache_free(f);
+}
+
+void cache_release(struct cached_file* f) {
+    if (--f->refs == 0 && f->evicted) cache_free(f);
+}
+
+/* Finds the entry for path in the given encoding, or returns null. */
+struct cached_file* cache_find(const char* path, int encoding) {
+    unsigned int h = hash_path(path);
+    struct cached_file* f = cache.buckets[h % CACHE_BUCKETS];
+    while (f) {
+        if (f->hash == h && f->encoding == encoding && 
+            strcmp(f->path, path) == 0) break;
+        f = f->hash_next;
+    }
+    if (!f) return 0;
+
+    /*
+    Without inotify, make sure the file hasn't changed since it was loaded, 
+    but only look at the disk once per CACHE_RECHECK_SECONDS.
+    */
+    if (cache.inotify_fd < 0) {
+        time_t now = time(0);
+        if (now - f->checked >= CACHE_RECHECK_SECONDS) {
+            struct stat st;
+            if (stat(path, &st) || st.st_mtime != f->mtime || 
+                    (!encoding && (size_t) st.st_size != f->size)) {
+                cache_remove(f);
+                return 0;
+            }
+            f->checked = now;
+        }
+    }
+
+    /* Move the entry to the front, marking it most recently used. */
+    if (cache.lru_head != f) {
+        lru_unlink(f);
+        lru_push_front(f);
+    }
+    return f;
+}
+
+/* Drops every entry for path, the file itself and its variants. */
+void cache_forget(const char* path) {
+    unsigned int h = hash_path(path);
+    struct cached_file* f = cache.buckets[h % CACHE_BUCKETS];
+    while (f) {
+        struct cached_file* next = f->hash_next;
+        if (f->hash == h && strcmp(f->path, path) == 0) cache_remove(f);
+        f = next;
+    }
+}
+
+/* Starts watching the directory containing path, unless it already is. */
+static void cache_watch(const char* path) {
+    if (cache.inotify_fd < 0) return;
+
+    char dir[MAX_FILE_PATH_SIZE + 1];
+    strcpy(dir, path);
+    char* slash = strrchr(dir, '/');
+    if (!slash) return;
+    *slash = 0;
+
+    int i;
+    for (i = 0; i < cache.watch_count; ++i) {
+        if (strcmp(cache.watches[i].dir, dir) == 0) return;
+    }
+    if (cache.watch_count == CACHE_MAX_WATCHES) return;
+
+    char* copy = strdup(dir);
+    if (!copy) return;
+    int wd = inotify_add_watch(cache.inotify_fd, dir, IN_MODIFY | 
+        IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | 
+        IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd < 0) {
+        free(copy);
+        return;
+    }
+
+    cache.watches[cache.watch_count].wd = wd;
+    cache.watches[cache.watch_count].dir = copy;
+    ++cache.watch_count;
+}
+
+/*
+Adds a new entry to the cache, evicting the least recently used entries to 
+make room for it.
+*/
+void cache_insert(struct cached_file* f) {
+    while (cache.lru_tail && cache.bytes + f->size > cache.budget) {
+        cache_remove(cache.lru_tail);
+    }
+
+    struct cached_file** bucket = &cache.buckets[f->hash % CACHE_BUCKETS];
+    f->hash_next = *bucket;
+    *bucket = f;
+    lru_push_front(f);
+    cache.bytes += f->size;
+}
+
+/*
+Loads the already opened file fd into the cache. Returns null if the file 
+is too large for the cache or couldn't be read, in which case the caller 
+sends it straight from disk instead.
+*/
+struct cached_file* cache_load(const char* path, int fd, size_t size, 
+        time_t mtime, ino_t inode) {
+    /* A single file may use at most a quarter of the budget. */
+    if (size > cache.budget / 4) return 0;
+
+    /* Watch before reading, so a write racing with the read is noticed. */
+    cache_watch(path);
+
+    char* data;
+    int mapped = size >= CACHE_MMAP_THRESHOLD;
+    if (mapped) {
+        data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) return 0;
+    } else {
+        data = malloc(size ? size : 1);
+        if (!data) return 0;
+        size_t got = 0;
+        while (got < size) {
+            ssize_t r = pread(fd, data + got, size - got, got);
+            if (r < 1) {
+                free(data);
+                return 0;
+            }
+            got += r;
+        }
+    }
+
+    struct cached_file* f = calloc(1, sizeof(*f) + strlen(path) + 1);
+    if (!f) {
+        if (mapped) munmap(data, size);
+        else free(data);
+        return 0;
+    }
+
+    f->path = (char*) (f + 1);
+    strcpy(f->path, path);
+    f->hash = hash_path(path);
+    f->data = data;
+    f->size = size;
+    f->mapped = mapped;
+    f->content_type = get_content_type(path);
+    format_etag(f->etag, inode, size, mtime);
+    f->header_length = format_file_header(f->header, f->etag, 
+        f->content_type, 0, size, mtime);
+    f->mtime = mtime;
+    f->checked = time(0);
+
+    cache_insert(f);
+    return f;
+}
+
+/*
+OPEN FILES
+
+Files too large for the file cache are sent from disk. Opening such a file, 
+fstat()ing it and working out its Content-Type on every request would cost 
+two system calls and some string handling each time, so the open file 
+descriptors are kept as well, keyed by path just like the file cache, with 
+the file's size, mtime and header lines alongside.
+
+One descriptor can be sent to any number of clients at once, because 
+sendfile(), splice(), pread() and io_uring's reads all take an explicit 
+offset and never move the file position. Every queued chunk sending from an 
+entry holds a reference on it, so an entry that is evicted while still in 
+use only has its descriptor closed by the last open_file_release().
+
+An entry is trusted for OPEN_FILE_TTL_MS. After that the next lookup stat()s 
+the path and drops the entry if the file was replaced (a different inode), 
+changed (size or mtime) or deleted. A change that inotify reports (see 
+cache_handle_events() below) drops the entry straight away. At most 
+open_file_limit descriptors are kept by each worker, and the least recently 
+used is closed first.
+*/
+#define OPEN_FILE_BUCKETS 512
+#define OPEN_FILE_TTL_MS 2000
+
+struct open_file {
+    /* Kept just after the entry, like a cached_file's. */
+    char* path;
+    unsigned int hash;
+    int fd;
+    size_t size;
+    time_t mtime;
+    dev_t device;
+    ino_t inode;
+    const char* content_type;
+    /* The header lines every response with this file's body carries. */
+    char header[256];
+    int header_length;
+    char etag[64];
+    /* When the file was last known to be unchanged (loop_ms). */
+    uint64_t checked;
+    int refs;
+    int evicted;
+    struct open_file* hash_next;
+    struct open_file* lru_prev;
+    struct open_file* lru_next;
+};
+
+struct open_files {
+    struct open_file* buckets[OPEN_FILE_BUCKETS];
+    struct open_file* lru_head;
+    struct open_file* lru_tail;
+    int count;
+};
+static __thread struct open_files open_files;
+static int open_file_limit = 256;
+
+static void open_file_unlink(struct open_file* f) {
+    if (f->lru_prev) f->lru_prev->lru_next = f->lru_next;
+    else open_files.lru_head = f->lru_next;
+    if (f->lru_next) f->lru_next->lru_prev = f->lru_prev;
+    else open_files.lru_tail = f->lru_prev;
+    f->lru_prev = f->lru_next = 0;
+}
+
+static void open_file_push_front(struct open_file* f) {
+    f->lru_prev = 0;
+    f->lru_next = open_files.lru_head;
+    if (open_files.lru_head) open_files.lru_head->lru_prev = f;
+    open_files.lru_head = f;
+    if (!open_files.lru_tail) open_files.lru_tail = f;
+}
+
+void open_file_release(struct open_file* f) {
+    if (--f->refs == 0 && f->evicted) {
+        close(f->fd);
+        free(f);
+    }
+}
+
+void open_file_remove(struct open_file* f) {
+    struct open_file** p = &open_files.buckets[f->hash % OPEN_FILE_BUCKETS];
+    while (*p != f) p = &(*p)->hash_next;
+    *p = f->hash_next;
+    open_file_unlink(f);
+    --open_files.count;
+
+    f->evicted = 1;
+    if (f->refs == 0) {
+        close(f->fd);
+        free(f);
+    }
+}
+
+static struct open_file* open_file_find(const char* path, unsigned int h) {
+    struct open_file* f = open_files.buckets[h % OPEN_FILE_BUCKETS];
+    while (f && (f->hash != h || strcmp(f->path, path))) f = f->hash_next;
+    return f;
+}
+
+/* Drops the entry for path, if there is one. */
+void open_file_forget(const char* path) {
+    struct open_file* f = open_file_find(path, hash_path(path));
+    if (f) open_file_remove(f);
+}
+
+void open_files_flush() {
+    while (open_files.lru_head) open_file_remove(open_files.lru_head);
+}
+
+/*
+Returns the open file for path, opening it if it isn't open already, or 
+null if it can't be opened or isn't a regular file. The caller gets a 
+reference of its own, and gives it back with open_file_release().
+*/
+struct open_file* open_file_get(const char* path) {
+    unsigned int h = hash_path(path);
+    struct open_file* f = open_file_find(path, h);
+
+    if (f && loop_ms - f->checked >= OPEN_FILE_TTL_MS) {
+        struct stat st;
+        if (stat(path, &st) || st.st_ino != f->inode || 
+                st.st_dev != f->device || st.st_mtime != f->mtime || 
+                (size_t) st.st_size != f->size) {
+            open_file_remove(f);
+            f = 0;
+        } else {
+            f->checked = loop_ms;
+        }
+    }
+    if (f) {
+        if (open_files.lru_head != f) {
+            open_file_unlink(f);
+            open_file_push_front(f);
+        }
+        ++f->refs;
+        return f;
+    }
+
+    /*
+    The file is opened with open() rather than fopen(), since sendfile() works 
+    on a plain file descriptor. fstat() then fills in a stat structure 
+    describing the open file, including its size in bytes, in a single call. 
+    Directories are not served.
+    */
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 0;
+    }
+
+    f = (struct open_file*) calloc(1, sizeof(*f) + strlen(path) + 1);
+    if (!f) {
+        close(fd);
+        return 0;
+    }
+    f->path = (char*) (f + 1);
+    strcpy(f->path, path);
+    f->hash = h;
+    f->fd = fd;
+    f->size = st.st_size;
+    f->mtime = st.st_mtime;
+    f->device = st.st_dev;
+    f->inode = st.st_ino;
+    f->content_type = get_content_type(path);
+    format_etag(f->etag, f->inode, f->size, f->mtime);
+    f->header_length = format_file_header(f->header, f->etag, 
+        f->content_type, 0, f->size, f->mtime);
+    f->checked = loop_ms;
+    f->refs = 1;
+
+    /* With a limit of 0 nothing is kept; the caller's reference closes it. */
+    if (open_file_limit <= 0) {
+        f->evicted = 1;
+        return f;
+    }
+    while (open_files.count >= open_file_limit) {
+        open_file_remove(open_files.lru_tail);
+    }
+    struct open_file** bucket = &open_files.buckets[h % OPEN_FILE_BUCKETS];
+    f->hash_next = *bucket;
+    *bucket = f;
+    open_file_push_front(f);
+    ++open_files.count;
+    return f;
+}
+
+/*
+Called when the inotify descriptor is readable. Each event names a file 
+within a watched directory, and any cached copy of that file is dropped. If 
+a watched directory itself goes away, or the kernel's event queue 
+overflowed, the whole cache is flushed to be safe.
+*/
+void cache_handle_events() {
+    char buffer[4096] 
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t len = read(cache.inotify_fd, buffer, sizeof(buffer));
+        if (len <= 0) break;
+
+        char* p = buffer;
+        while (p < buffer + len) {
+            struct inotify_event* ev = (struct inotify_event*) p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            int i;
+            if (ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | 
+                    IN_IGNORED)) {
+                while (cache.lru_head) cache_remove(cache.lru_head);
+                open_files_flush();
+
+                /* The kernel dropped this watch, so forget about it too. */
+                if (ev->mask & IN_IGNORED) {
+                    for (i = 0; i < cache.watch_count; ++i) {
+                        if (cache.watches[i].wd == ev->wd) {
+                            free(cache.watches[i].dir);
+                            cache.watches[i] = 
+                                cache.watches[--cache.watch_count];
+                            break;
+                        }
+                    }
+                }
+                continue;
+            }
+            if (!ev->len) continue;
+
+            for (i = 0; i < cache.watch_count; ++i) {
+                if (cache.watches[i].wd != ev->wd) continue;
+
+                char path[MAX_FILE_PATH_SIZE + NAME_MAX + 2];
+                snprintf(path, sizeof(path), "%s/%s", 
+                    cache.watches[i].dir, ev->name);
+                cache_forget(path);
+                open_file_forget(path);
+
+                /* A changed .gz sibling makes its file's variants stale. */
+                size_t length = strlen(path);
+                if (length > 3 && strcmp(path + length - 3, ".gz") == 0) {
+                    path[length - 3] = 0;
+                    cache_forget(path);
+                }
+                break;
+            }
+        }
+    }
+}
+
+/*
+OUTPUT QUEUE
+
+Responses are not written to the socket immediately. Instead each client has 
+a queue of chunks waiting to be sent, and flush_client() writes as much of 
+the queue as the socket will take without blocking. Whatever is left stays 
+queued until epoll reports the socket writable again (EPOLLOUT), so one 
+client that reads slowly never holds up the rest of the server.
+
+A chunk is either a run of bytes in memory or a range of an open file. Small 
+pieces such as headers are copied into the chunk itself; cached file bodies 
+are referenced in place, holding a reference on their cache entry so it 
+can't be freed while still being sent; files from disk are sent with 
+sendfile(), falling back to splice() and finally to pread() and send(), 
+holding a reference on their entry in the open files (see OPEN FILES).
+
+Used chunks are kept on a free list and reused, so queuing a response 
+normally doesn't allocate.
+*/
+#define CHUNK_INLINE_SIZE 256
+
+enum { CHUNK_MEMORY, CHUNK_FILE };
+enum { FILE_SENDFILE, FILE_SPLICE, FILE_COPY };
+
+struct out_chunk {
+    int kind;
+    /* CHUNK_MEMORY: data points into inline_data, owned or a cache entry. */
+    const char* data;
+    char* owned;
+    struct cached_file* file_ref;
+    char inline_data[CHUNK_INLINE_SIZE];
+    /* CHUNK_FILE: the range [offset, offset + length) of fd, which belongs 
+    to open_ref. */
+    int fd;
+    struct open_file* open_ref;
+    off_t offset;
+    int file_mode;
+    int pipe_fds[2];
+    size_t in_pipe;
+    /* Bytes of this chunk still to be sent. */
+    size_t length;
+    struct out_chunk* next;
+};
+static __thread struct out_chunk* free_chunks;
+
+/*
+Limit on queued response bytes per client. While a client has more than 
+this waiting to be sent, the server stops reading its further requests, so 
+a pipelining client that never reads can't make us queue unbounded data.
+*/
+static size_t max_queued = 256 * 1024;
+
+struct out_chunk* chunk_alloc() {
+    struct out_chunk* c = free_chunks;
+    if (c) {
+        free_chunks = c->next;
+    } else {
+        c = (struct out_chunk*) malloc(sizeof(*c));
+        if (!c) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(1);
+        }
+    }
+    c->data = 0;
+    c->owned = 0;
+    c->file_ref = 0;
+    c->fd = -1;
+    c->open_ref = 0;
+    c->offset = 0;
+    c->file_mode = FILE_SENDFILE;
+    c->pipe_fds[0] = c->pipe_fds[1] = -1;
+    c->in_pipe = 0;
+    c->length = 0;
+    c->next = 0;
+    return c;
+}
+
+void chunk_free(struct out_chunk* c) {
+    if (c->owned) free(c->owned);
+    if (c->file_ref) cache_release(c->file_ref);
+    if (c->open_ref) open_file_release(c->open_ref);
+    if (c->pipe_fds[0] >= 0) {
+        close(c->pipe_fds[0]);
+        close(c->pipe_fds[1]);
+    }
+    c->next = free_chunks;
+    free_chunks = c;
+}
+
+static void queue_chunk(struct client_info* client, struct out_chunk* c) {
+    if (client->out_tail) client->out_tail->next = c;
+    else client->out_head = c;
+    client->out_tail = c;
+    client->out_bytes += c->length;
+}
+
+/* Queues a copy of length bytes of data. */
+void queue_bytes(struct client_info* client, const char* data, 
+        size_t length) {
+    struct out_chunk* c = chunk_alloc();
+    c->kind = CHUNK_MEMORY;
+    if (length <= CHUNK_INLINE_SIZE) {
+        memcpy(c->inline_data, data, length);
+        c->data = c->inline_data;
+    } else {
+        c->owned = (char*) malloc(length);
+        if (!c->owned) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(1);
+        }
+        memcpy(c->owned, data, length);
+        c->data = c->owned;
+    }
+    c->length = length;
+    queue_chunk(client, c);
+}
+
+/* Queues length bytes of a cached file from offset, without copying them. */
+void queue_cached(struct client_info* client, struct cached_file* f, 
+        size_t offset, size_t length) {
+    struct out_chunk* c = chunk_alloc();
+    c->kind = CHUNK_MEMORY;
+    c->data = f->data + offset;
+    c->length = length;
+    if (!f->packed) {
+        c->file_ref = f;
+        ++f->refs;
+    }
+    queue_chunk(client, c);
+}
+
+/* Queues length bytes of an open file from offset. */
+void queue_file(struct client_info* client, struct open_file* f, 
+        off_t offset, size_t length) {
+    struct out_chunk* c = chunk_alloc();
+    c->kind = CHUNK_FILE;
+    c->fd = f->fd;
+    c->open_ref = f;
+    ++f->refs;
+    c->offset = offset;
+    c->length = length;
+    queue_chunk(client, c);
+}
+
+void clear_queue(struct client_info* client) {
+    while (client->out_head) {
+        struct out_chunk* c = client->out_head;
+        client->out_head = c->next;
+        chunk_free(c);
+    }
+    client->out_tail = 0;
+    client->out_bytes = 0;
+}
+
+/*
+Sends part of a file chunk. Returns the number of bytes sent, 0 if the 
+socket is full, or -1 on error.
+*/
+ssize_t send_file_chunk(struct client_info* client, struct out_chunk* c) {
+    /*
+    sendfile() asks the kernel to copy straight from the page cache into the 
+    socket, so the data never passes through a buffer in our program. It 
+    advances offset by however much was sent.
+    */
+    if (c->file_mode == FILE_SENDFILE) {
+        ssize_t sent = sendfile(client->socket, c->fd, &c->offset, 
+            c->length);
+        if (sent > 0) return sent;
+        /* The file got shorter while we were sending it. */
+        if (sent == 0) return -1;
+        if (errno == EAGAIN || errno == EINTR) return 0;
+        if (errno != EINVAL && errno != ENOSYS) return -1;
+        c->file_mode = FILE_SPLICE;
+    }
+
+    /*
+    splice() moves data between a file descriptor and a pipe without 
+    copying it into user space, so the file is spliced into a pipe and the 
+    pipe is spliced into the socket. Data can sit in the pipe while the 
+    socket is full; in_pipe tracks how much.
+    */
+    if (c->file_mode == FILE_SPLICE) {
+        if (c->pipe_fds[0] < 0 && pipe2(c->pipe_fds, O_NONBLOCK)) {
+            c->file_mode = FILE_COPY;
+        }
+    }
+    if (c->file_mode == FILE_SPLICE) {
+        if (!c->in_pipe) {
+            ssize_t in = splice(c->fd, &c->offset, c->pipe_fds[1], 0, 
+                c->length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (in == 0) return -1;
+            if (in < 0) {
+                if (errno == EAGAIN || errno == EINTR) return 0;
+                if (errno != EINVAL && errno != ENOSYS) return -1;
+                c->file_mode = FILE_COPY;
+            } else {
+                c->in_pipe = in;
+            }
+        }
+        if (c->file_mode == FILE_SPLICE) {
+            ssize_t out = splice(c->pipe_fds[0], 0, client->socket, 0, 
+                c->in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (out < 0) {
+                if (errno == EAGAIN || errno == EINTR) return 0;
+                return -1;
+            }
+            c->in_pipe -= out;
+            return out;
+        }
+    }
+
+    /*
+    Last resort: copy through a buffer. If the socket only takes part of it, 
+    the offset only advances by what was sent, and the rest is read again 
+    next time.
+    */
+    char buffer[16384];
+    size_t want = c->length < sizeof(buffer) ? c->length : sizeof(buffer);
+    ssize_t r = pread(c->fd, buffer, want, c->offset);
+    if (r < 1) return -1;
+    ssize_t sent = send(client->socket, buffer, r, MSG_NOSIGNAL);
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        return -1;
+    }
+    c->offset += sent;
+    return sent;
+}
+
+/*
+Removes sent bytes from the front of the queue, freeing the chunks that were 
+sent completely.
+*/
+void retire_sent(struct client_info* client, size_t sent) {
+    client->out_bytes -= sent;
+    client->last_progress = loop_ms;
+    self->stats.bytes_sent += sent;
+
+    if (!client->first_byte_sent || (!client->out_bytes && 
+            client->response_us)) {
+        uint64_t now = now_us();
+        if (!client->first_byte_sent) {
+            hist_record(&self->stats.first_byte, now - client->accepted_us);
+            client->first_byte_sent = 1;
+        }
+        if (!client->out_bytes && client->response_us) {
+            hist_record(&self->stats.response, now - client->response_us);
+            client->response_us = 0;
+        }
+    }
+    while (sent > 0) {
+        struct out_chunk* c = client->out_head;
+        if (sent < c->length) {
+            if (c->kind == CHUNK_MEMORY) c->data += sent;
+            c->length -= sent;
+            break;
+        }
+        sent -= c->length;
+        client->out_head = c->next;
+        if (!client->out_head) client->out_tail = 0;
+        chunk_free(c);
+    }
+}
+
+/*
+Writes as much of the client's queue as the socket accepts. Consecutive 
+memory chunks are sent together with one sendmsg() (a "gather" write), so a 
+header and its body leave in the same TCP segment. When a header is followed 
+by a file, MSG_MORE tells the kernel more data is coming so the header waits 
+to share a segment with the start of the file.
+
+Returns 0 when the queue is empty, 1 if data remains because the socket is 
+full, or -1 if the connection failed.
+*/
+int flush_client(struct client_info* client) {
+    while (client->out_head) {
+        struct out_chunk* c = client->out_head;
+        ssize_t sent;
+
+        if (c->kind == CHUNK_MEMORY) {
+#define MAX_IOV 16
+            struct iovec iov[MAX_IOV];
+            int count = 0;
+            struct out_chunk* n = c;
+            while (n && n->kind == CHUNK_MEMORY && count < MAX_IOV) {
+                iov[count].iov_base = (char*) n->data;
+                iov[count].iov_len = n->length;
+                ++count;
+                n = n->next;
+            }
+
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            sent = sendmsg(client->socket, &msg, 
+                MSG_NOSIGNAL | (n ? MSG_MORE : 0));
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || 
+                    errno == EINTR) return 1;
+                return -1;
+            }
+        } else {
+            sent = send_file_chunk(client, c);
+            if (sent < 0) return -1;
+            if (sent == 0) return 1;
+        }
+
+        retire_sent(client, sent);
+    }
+    return 0;
+}
+
+/*
+REQUEST PARSER
+
+The parser itself is in request_parser.h, where parse_bench can get at it. 
+These look up what it found in a client's request.
+*/
+
+/* Compares a slice of the request with a string, ignoring case. */
+int slice_is(struct client_info* client, struct slice s, const char* text) {
+    return s.length == (int) strlen(text) && 
+        strncasecmp(client->request + s.start, text, s.length) == 0;
+}
+
+/* Returns the value of the named header, or 0 if the request has none. */
+struct slice* find_header(struct client_info* client, const char* name) {
+    int i;
+    for (i = 0; i < client->in->parser.header_count; ++i) {
+        if (slice_is(client, client->in->parser.headers[i].name, name)) {
+            return &client->in->parser.headers[i].value;
+        }
+    }
+    return 0;
+}
+
+/*
+REQUEST BUFFERS
+
+A client only needs somewhere to put its request while one is actually 
+arriving. Most of the time a keep-alive connection is idle, waiting for the 
+next request, and giving every connection its own fixed buffer would pin 
+that memory for nothing (and cap the request at whatever size was chosen).
+
+Instead a buffer is attached to a client when data is about to be read, and 
+given back as soon as everything in it has been parsed and answered. Buffers 
+come in a few size classes. A request starts in the smallest, and one that 
+outgrows it is moved to the next class up, so a request with large cookies 
+still fits while ordinary requests use 1 KiB. The total is capped by 
+max_header_bytes. The parser's state lives in the buffer too, since it is 
+only needed while the request is.
+
+Each worker keeps a free list per class, so attaching and releasing a buffer 
+is normally a pointer swap, not a trip to malloc(). At most 
+REQUEST_BUFFERS_KEPT buffers of each class are kept on a list; any beyond 
+that are freed.
+*/
+#define REQUEST_CLASSES 4
+#define REQUEST_BUFFERS_KEPT 128
+
+static const int request_class_size[REQUEST_CLASSES] = { 
+    1024, 4096, 16384, 65536 
+};
+static int max_header_bytes = 16384;
+
+struct request_pool {
+    struct request_buffer* free[REQUEST_CLASSES];
+    int kept[REQUEST_CLASSES];
+};
+static __thread struct request_pool request_pool;
+
+static struct request_buffer* request_buffer_get(int size_class) {
+    struct request_buffer* b = request_pool.free[size_class];
+    if (b) {
+        request_pool.free[size_class] = b->next;
+        --request_pool.kept[size_class];
+    } else {
+        int capacity = request_class_size[size_class];
+        /* One more byte for the null terminator. */
+        b = (struct request_buffer*) malloc(sizeof(*b) + capacity + 1);
+        if (!b) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(1);
+        }
+        b->capacity = capacity;
+        b->size_class = size_class;
+    }
+    self->stats.buffer_bytes += b->capacity;
+    return b;
+}
+
+static void request_buffer_put(struct request_buffer* b) {
+    self->stats.buffer_bytes -= b->capacity;
+    if (request_pool.kept[b->size_class] >= REQUEST_BUFFERS_KEPT) {
+        free(b);
+        return;
+    }
+    b->next = request_pool.free[b->size_class];
+    request_pool.free[b->size_class] = b;
+    ++request_pool.kept[b->size_class];
+}
+
+/*
+Makes room in the client's request buffer for want more bytes, attaching a 
+buffer or moving to a larger one as needed, but never beyond 
+max_header_bytes in all. Returns how many bytes can be added now, which may 
+be fewer than want, or 0 if the request has already reached the limit.
+*/
+int request_reserve(struct client_info* client, int want) {
+    int limit = max_header_bytes - client->received;
+    if (limit <= 0) return 0;
+    if (want > limit) want = limit;
+    int need = client->received + want;
+
+    struct request_buffer* old = client->in;
+    if (!old || old->capacity < need) {
+        int size_class = 0;
+        while (size_class < REQUEST_CLASSES - 1 && 
+            request_class_size[size_class] < need) ++size_class;
+
+        struct request_buffer* b = request_buffer_get(size_class);
+        if (old) {
+            /* Offsets, not pointers, so the parser's state copies as is. */
+            b->parser = old->parser;
+            memcpy(b->data, old->data, client->received + 1);
+            request_buffer_put(old);
+        } else {
+            parser_reset(&b->parser);
+            b->data[0] = 0;
+        }
+        client->in = b;
+        client->request = b->data;
+    }
+
+    int room = client->in->capacity - client->received;
+    return room < limit ? room : limit;
+}
+
+/* Gives the client's buffer back to the pool, if it holds nothing. */
+void request_release(struct client_info* client) {
+    if (!client->in || client->received) return;
+    request_buffer_put(client->in);
+    client->in = 0;
+    client->request = 0;
+}
+
+/*
+ACCESS LOG
+
+Every request is recorded in an access log, in the Combined Log Format used 
+by Apache and nginx or, with --log-format json, as one JSON object per line.
+
+Writing the log from the event loop would mean a formatted write to a file 
+for every request, which is slow and can block. Instead each worker copies 
+the facts about the request (address, request line, status, size and so on) 
+into a ring buffer of its own, and a single background thread takes them 
+out, formats them and writes them in large batches.
+
+Each ring has exactly one writer (the worker) and one reader (the log 
+thread), so no lock is needed: the worker only ever moves tail forward, the 
+reader only moves head, and each publishes its position with an atomic 
+store that the other reads with an atomic load. If the log thread falls 
+behind and a ring fills up, records are dropped and counted rather than 
+making the worker wait.
+*/
+struct log_record {
+    /* Size of the whole record, including this header; 0 marks a wrap. */
+    uint32_t length;
+    uint16_t status;
+    uint16_t address_length;
+    uint16_t request_length;
+    uint16_t referer_length;
+    uint16_t agent_length;
+    time_t time;
+    uint64_t bytes;
+    /* Followed by the address, request line, referer and user agent. */
+};
+
+enum { LOG_COMBINED, LOG_JSON };
+static int log_format = LOG_COMBINED;
+static const char* access_log_path = "-";
+static int log_fd = -1;
+
+/* Longest request line or header value copied into the log. */
+#define LOG_FIELD_MAX 1024
+
+static char* log_append(char* p, const char* text, int length) {
+    if (length > LOG_FIELD_MAX) length = LOG_FIELD_MAX;
+    memcpy(p, text, length);
+    return p + length;
+}
+
+/* Records the request the client has just been answered for. */
+void access_log(struct client_info* client) {
+    if (log_fd < 0) return;
+    struct log_ring* ring = &self->log;
+    struct http_request* req = &client->in->parser;
+
+    const char* request = client->request;
+    int request_length = 0;
+    if (req->state == P_END_LF) {
+        request_length = req->version.start + req->version.length;
+    }
+    if (request_length > LOG_FIELD_MAX) request_length = LOG_FIELD_MAX;
+    struct slice empty = { 0, 0 };
+    struct slice* referer = find_header(client, "Referer");
+    struct slice* agent = find_header(client, "User-Agent");
+    if (!referer || req->state != P_END_LF) referer = &empty;
+    if (!agent || req->state != P_END_LF) agent = &empty;
+    int referer_length = referer->length < LOG_FIELD_MAX ? 
+        referer->length : LOG_FIELD_MAX;
+    int agent_length = agent->length < LOG_FIELD_MAX ? 
+        agent->length : LOG_FIELD_MAX;
+    int address_length = strlen(client->address_text);
+
+    /* Records are kept 8-byte aligned. */
+    uint32_t length = sizeof(struct log_record) + address_length + 
+        request_length + referer_length + agent_length;
+    length = (length + 7) & ~7u;
+
+    /*
+    A record is never split across the end of the ring. If it doesn't fit 
+    in the space left before the end, that space is skipped.
+    */
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t offset = tail & (LOG_RING_SIZE - 1);
+    size_t skip = LOG_RING_SIZE - offset < length ? 
+        LOG_RING_SIZE - offset : 0;
+    if (LOG_RING_SIZE - (tail - head) < skip + length) {
+        ++self->stats.log_dropped;
+        return;
+    }
+    if (skip) {
+        ((struct log_record*) (ring->data + offset))->length = 0;
+        tail += skip;
+        offset = 0;
+    }
+
+    struct log_record* r = (struct log_record*) (ring->data + offset);
+    r->length = length;
+    r->status = client->status;
+    r->address_length = address_length;
+    r->request_length = request_length;
+    r->referer_length = referer_length;
+    r->agent_length = agent_length;
+    r->time = time(0);
+    r->bytes = client->body_bytes;
+    char* p = (char*) (r + 1);
+    p = log_append(p, client->address_text, address_length);
+    p = log_append(p, request, request_length);
+    p = log_append(p, request + referer->start, referer_length);
+    log_append(p, request + agent->start, agent_length);
+
+    /* Publish the record; the release makes its contents visible first. */
+    __atomic_store_n(&ring->tail, tail + length, __ATOMIC_RELEASE);
+}
+
+/*
+Copies text into out, escaping anything that would break the line: quotes, 
+backslashes, control characters and anything outside ASCII (which may not be 
+valid UTF-8, and so can't go into JSON as is). Combined format uses \xHH 
+escapes as Apache does, JSON uses \u00HH.
+*/
+static char* log_escape(char* out, const char* text, int length) {
+    int i;
+    for (i = 0; i < length; ++i) {
+        unsigned char ch = text[i];
+        if (ch == '"' || ch == '\\') {
+            *out++ = '\\';
+            *out++ = ch;
+        } else if (ch < 0x20 || ch >= 0x7f) {
+            out += sprintf(out, log_format == LOG_JSON ? "\\u%04x" : "\\x%02x", 
+                ch);
+        } else {
+            *out++ = ch;
+        }
+    }
+    return out;
+}
+
+/* Formats one record as a line of text into out, returning its end. */
+static char* log_format_record(char* out, struct log_record* r) {
+    static time_t formatted_time = -1;
+    static char time_text[64];
+    if (r->time != formatted_time) {
+        struct tm tm;
+        localtime_r(&r->time, &tm);
+        strftime(time_text, sizeof(time_text), log_format == LOG_JSON ? 
+            "%Y-%m-%dT%H:%M:%S%z" : "%d/%b/%Y:%H:%M:%S %z", &tm);
+        formatted_time = r->time;
+    }
+
+    const char* address = (const char*) (r + 1);
+    const char* request = address + r->address_length;
+    const char* referer = request + r->request_length;
+    const char* agent = referer + r->referer_length;
+
+    if (log_format == LOG_JSON) {
+        out += sprintf(out, "{\"time\":\"%s\",\"remote\":\"%.*s\","
+            "\"request\":\"", time_text, r->address_length, address);
+        out = log_escape(out, request, r->request_length);
+        out += sprintf(out, "\",\"status\":%u,\"bytes\":%llu,\"referer\":\"", 
+            r->status, (unsigned long long) r->bytes);
+        out = log_escape(out, referer, r->referer_length);
+        out += sprintf(out, "\",\"agent\":\"");
+        out = log_escape(out, agent, r->agent_length);
+        out += sprintf(out, "\"}\n");
+        return out;
+    }
+
+    out += sprintf(out, "%.*s - - [%s] \"", r->address_length, address, 
+        time_text);
+    out = log_escape(out, request, r->request_length);
+    out += sprintf(out, "\" %u ", r->status);
+    if (r->bytes) out += sprintf(out, "%llu", (unsigned long long) r->bytes);
+    else *out++ = '-';
+    out += sprintf(out, " \"");
+    out = log_escape(out, r->referer_length ? referer : "-", 
+        r->referer_length ? r->referer_length : 1);
+    out += sprintf(out, "\" \"");
+    out = log_escape(out, r->agent_length ? agent : "-", 
+        r->agent_length ? r->agent_length : 1);
+    out += sprintf(out, "\"\n");
+    return out;
+}
+
+static void log_write(const char* data, size_t length) {
+    while (length) {
+        ssize_t w = write(log_fd, data, length);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        data += w;
+        length -= w;
+    }
+}
+
+/*
+Takes everything currently in one worker's ring, writing it out through 
+batch. Returns the number of records taken.
+*/
+static int log_drain(struct log_ring* ring, char* batch, size_t* used, 
+        size_t batch_size) {
+    int taken = 0;
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        size_t offset = head & (LOG_RING_SIZE - 1);
+        struct log_record* r = (struct log_record*) (ring->data + offset);
+        if (r->length == 0) {
+            head += LOG_RING_SIZE - offset;
+            continue;
+        }
+
+        /* Each escaped byte takes at most six characters. */
+        if (*used + 6 * r->length + 256 > batch_size) {
+            log_write(batch, *used);
+            *used = 0;
+        }
+        *used = log_format_record(batch + *used, r) - batch;
+        head += r->length;
+        ++taken;
+    }
+
+    /* Hand the space back to the worker. */
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    return taken;
+}
+
+static volatile int log_running = 1;
+
+void* log_main(void* arg) {
+    (void) arg;
+    size_t batch_size = 256 * 1024;
+    char* batch = (char*) malloc(batch_size);
+    if (!batch) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        return 0;
+    }
+
+    while (1) {
+        int stopping = !__atomic_load_n(&log_running, __ATOMIC_ACQUIRE);
+        size_t used = 0;
+        int taken = 0;
+        int i;
+        for (i = 0; i < worker_count; ++i) {
+            taken += log_drain(&workers[i].log, batch, &used, batch_size);
+        }
+        if (used) log_write(batch, used);
+        if (stopping) break;
+
+        /* Nothing to do; look again shortly. */
+        if (!taken) {
+            struct timespec pause = { 0, 20 * 1000000 };
+            nanosleep(&pause, 0);
+        }
+    }
+
+    free(batch);
+    return 0;
+}
+
+/* The Connection header matching the client's keep-alive state. */
+const char* connection_header(struct client_info* client) {
+    return client->keep_alive ? "Connection: keep-alive\r\n" : 
+        "Connection: close\r\n";
+}
+
+/*
+Counts the response just queued by its status, and starts the clock on it 
+unless an earlier response is still being sent, in which case the time is 
+measured until the whole queue has gone.
+*/
+void count_response(struct client_info* client) {
+    unsigned i;
+    for (i = 0; i < STATUS_KINDS - 1; ++i) {
+        if (tracked_status[i] == client->status) break;
+    }
+    ++self->stats.responses[i];
+    if (!client->response_us) client->response_us = now_us();
+}
+
+/* Adds up every worker's counters into total. */
+void merge_stats(struct worker_stats* total) {
+    memset(total, 0, sizeof(*total));
+    int i;
+    unsigned k;
+    for (i = 0; i < worker_count; ++i) {
+        struct worker_stats* s = &workers[i].stats;
+        total->accepts += s->accepts;
+        total->rejected += s->rejected;
+        total->limited += s->limited;
+        total->requests += s->requests;
+        total->bytes_sent += s->bytes_sent;
+        total->log_dropped += s->log_dropped;
+        for (k = 0; k < STATUS_KINDS; ++k) {
+            total->responses[k] += s->responses[k];
+        }
+        total->active += s->active;
+        total->buffer_bytes += s->buffer_bytes;
+        total->pool_high_water += s->pool_high_water;
+        hist_merge(&total->first_byte, &s->first_byte);
+        hist_merge(&total->response, &s->response);
+        hist_merge(&total->accept_batch, &s->accept_batch);
+    }
+}
+
+static char* format_histogram(char* out, const char* name, 
+        const struct histogram* h, int json) {
+    double mean = h->count ? (double) h->sum / h->count : 0;
+    return out + sprintf(out, json ? 
+        ",\"%s\":{\"count\":%lu,\"mean\":%.1f,\"p50\":%llu,\"p90\":%llu,"
+        "\"p99\":%llu,\"p99.9\":%llu,\"max\":%llu}" : 
+        "%s count=%lu mean=%.1f p50=%llu p90=%llu p99=%llu p99.9=%llu "
+        "max=%llu\n", name, h->count, mean, 
+        (unsigned long long) hist_percentile(h, 0.5), 
+        (unsigned long long) hist_percentile(h, 0.9), 
+        (unsigned long long) hist_percentile(h, 0.99), 
+        (unsigned long long) hist_percentile(h, 0.999), 
+        (unsigned long long) h->max);
+}
+
+/*
+Writes the server's statistics into out, as "name value" lines or as a 
+JSON object. out must have room for STATS_TEXT_SIZE bytes.
+*/
+#define STATS_TEXT_SIZE 2048
+
+int format_stats(char* out, int json) {
+    /* Too big to want on the stack of every caller; a worker's own copy. */
+    static __thread struct worker_stats total;
+    merge_stats(&total);
+
+    /*
+    CPU time used by the whole process so far, user and system together, 
+    for comparing how much work the same load costs with different settings.
+    */
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + 
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+
+    char* p = out;
+    const char* f = json ? 
+        "{\"workers\":%d,\"accepts\":%lu,\"rejected\":%lu,"
+        "\"limited\":%lu,\"active\":%d,\"pool_high_water\":%d,"
+        "\"buffer_bytes\":%ld,\"requests\":%lu,\"bytes_sent\":%lu,"
+        "\"log_dropped\":%lu,\"cpu_seconds\":%.3f,\"responses\":{" : 
+        "workers %d\naccepts %lu\nrejected %lu\nlimited %lu\nactive %d\n"
+        "pool_high_water %d\nbuffer_bytes %ld\nrequests %lu\n"
+        "bytes_sent %lu\nlog_dropped %lu\ncpu_seconds %.3f\n";
+    p += sprintf(p, f, worker_count, total.accepts, total.rejected, 
+        total.limited, total.active, total.pool_high_water, 
+        total.buffer_bytes, total.requests, total.bytes_sent, 
+        total.log_dropped, cpu);
+
+    unsigned k;
+    for (k = 0; k < STATUS_KINDS; ++k) {
+        char code[16];
+        if (k < STATUS_KINDS - 1) sprintf(code, "%d", tracked_status[k]);
+        else strcpy(code, "other");
+        p += sprintf(p, json ? "%s\"%s\":%lu" : "responses_%s%s %lu\n", 
+            json && k ? "," : "", code, total.responses[k]);
+    }
+    if (json) p += sprintf(p, "}");
+
+    p = format_histogram(p, "first_byte_us", &total.first_byte, json);
+    p = format_histogram(p, "response_us", &total.response, json);
+    p = format_histogram(p, "accepts_per_wakeup", &total.accept_batch, json);
+    if (json) p += sprintf(p, "}\n");
+    return p - out;
+}
+
+/*
+Answers with a body made up on the spot, which no cache between us and the 
+client should keep, since the next one will be different.
+*/
+void serve_dynamic(struct client_info* client, const char* content_type, 
+        const char* body, int body_length) {
+    char header[256];
+    int header_length = sprintf(header, "HTTP/1.1 200 OK\r\n%s"
+        "Content-Length: %d\r\nContent-Type: %s\r\n"
+        "Cache-Control: no-store\r\n\r\n", connection_header(client), 
+        body_length, content_type);
+
+    client->status = 200;
+    client->body_bytes = client->head_only ? 0 : body_length;
+    queue_bytes(client, header, header_length);
+    if (!client->head_only) queue_bytes(client, body, body_length);
+}
+
+/*
+Answers /__stats, which is reserved for the server's own statistics: plain 
+text by default, or JSON for /__stats?format=json.
+*/
+void serve_stats(struct client_info* client, int json) {
+    char body[STATS_TEXT_SIZE];
+    int body_length = format_stats(body, json);
+    serve_dynamic(client, json ? "application/json" : "text/plain", body, 
+        body_length);
+}
+
+/*
+If the client has sent an HTTP request that the server does not understand, 
+this function which neatly encapsulates the error behaviour is called. We 
+can't tell where a malformed request ends, so the connection is always 
+closed afterwards.
+*/
+void send_400(struct client_info* client) {
+    const char* c400 = "HTTP/1.1 400 Bad Request\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 11\r\n\r\nBad Request";
+
+    client->keep_alive = 0;
+    client->status = 400;
+    client->body_bytes = 11;
+    queue_bytes(client, c400, strlen(c400));
+}
+
+/*
+Sent when a client's address has run out of request tokens (see PER-IP 
+LIMITS). The connection is closed too, so the client has to wait before 
+trying again.
+*/
+void send_429(struct client_info* client) {
+    const char* c429 = "HTTP/1.1 429 Too Many Requests\r\n"
+        "Connection: close\r\n"
+        "Retry-After: 1\r\n"
+        "Content-Length: 17\r\n\r\nToo Many Requests";
+
+    client->keep_alive = 0;
+    client->status = 429;
+    client->body_bytes = 17;
+    queue_bytes(client, c429, strlen(c429));
+}
+
+/*
+Sent when a request's header grows past max_header_bytes. As with a 400, 
+there's no telling where the request would have ended, so the connection is 
+closed afterwards.
+*/
+void send_431(struct client_info* client) {
+    const char *c431 = "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 31\r\n\r\nRequest Header Fields Too Large";
+
+    client->keep_alive = 0;
+    client->status = 431;
+    client->body_bytes = 31;
+    queue_bytes(client, c431, strlen(c431));
+}
+
+/*
+Sent when the path exists but not for the request's method; allowed has a 
+bit for each method it does have (see router.h). The request may have a 
+body, which the server doesn't read, so the connection is closed.
+*/
+void send_405(struct client_info* client, int allowed) {
+    char c405[256];
+    char* p = c405 + sprintf(c405, "HTTP/1.1 405 Method Not Allowed\r\n"
+        "Connection: close\r\nAllow: ");
+    int i, listed = 0;
+    for (i = 0; i < ROUTE_METHODS; ++i) {
+        if (allowed & (1 << i)) {
+            p += sprintf(p, "%s%s", listed++ ? ", " : "", 
+                route_method_names[i]);
+        }
+    }
+    p += sprintf(p, "\r\nContent-Length: 18\r\n\r\nMethod Not Allowed");
+
+    client->keep_alive = 0;
+    client->status = 405;
+    client->body_bytes = 18;
+    queue_bytes(client, c405, p - c405);
+}
+
+/* A 404 is an ordinary response, so the connection may stay open. */
+void send_404(struct client_info* client) {
+    char c404[128];
+    int length = sprintf(c404, "HTTP/1.1 404 Not Found\r\n%s"
+        "Content-Length: 9\r\n\r\n%s", connection_header(client), 
+        client->head_only ? "" : "Not Found");
+    client->status = 404;
+    client->body_bytes = client->head_only ? 0 : 9;
+
+    queue_bytes(client, c404, length);
+}
+
+/*
+CONDITIONAL REQUESTS
+
+A browser or CDN that already has a copy of a file doesn't want the whole 
+file again just to find out it hasn't changed. Every response with a file 
+carries two validators describing the version sent:
+
+    ETag: "2a41c3-3e8-671043e1"     an opaque tag (here inode-size-mtime)
+    Last-Modified: Wed, 16 Oct 2024 20:33:05 GMT
+
+To check its copy, the client repeats them in its next request, as 
+"If-None-Match: <tag>" or "If-Modified-Since: <date>". If the file still 
+matches, the answer is "304 Not Modified" with no body at all, and the 
+client keeps using what it has. If-None-Match takes precedence when both 
+are sent, since a tag is more exact than a time to the second.
+
+If-Range does the same for range requests: the ranges are only honoured if 
+the file is still the version the client has part of, and otherwise the 
+whole file is sent.
+*/
+
+/*
+Reads the HTTP date in the header value s into *t. Returns 0 on success. 
+Only the preferred format is understood ("Sun, 06 Nov 1994 08:49:37 GMT"); 
+a date in another format just means the condition is ignored.
+*/
+static int parse_http_date(struct client_info* client, struct slice* s, 
+        time_t* t) {
+    char text[64];
+    if (s->length >= (int) sizeof(text)) return -1;
+    memcpy(text, client->request + s->start, s->length);
+    text[s->length] = 0;
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char* end = strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end) return -1;
+    *t = timegm(&tm);
+    return 0;
+}
+
+/*
+Checks whether etag is among the entity tags in the If-None-Match value s, 
+a comma separated list of quoted tags or "*" for any. This is the weak 
+comparison, which ignores a "W/" prefix.
+*/
+static int etag_listed(struct client_info* client, struct slice* s, 
+        const char* etag) {
+    const char* p = client->request + s->start;
+    const char* end = p + s->length;
+    int etag_length = strlen(etag);
+    while (p < end) {
+        if (*p == ' ' || *p == '\t' || *p == ',') {
+            ++p;
+            continue;
+        }
+        if (*p == '*') return 1;
+        if (end - p > 2 && p[0] == 'W' && p[1] == '/') p += 2;
+
+        const char* tag = p;
+        if (*p != '"') return 0;
+        p = memchr(p + 1, '"', end - p - 1);
+        if (!p) return 0;
+        ++p;
+        if (p - tag == etag_length && memcmp(tag, etag, etag_length) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+Answers a GET or HEAD with "304 Not Modified" if the client's copy of the 
+file (with the given validators and content type) is still current. Returns 
+1 if it did.
+*/
+int serve_not_modified(struct client_info* client, const char* etag, 
+        time_t mtime, const char* content_type) {
+    struct slice* match = find_header(client, "If-None-Match");
+    struct slice* since = find_header(client, "If-Modified-Since");
+    time_t date;
+
+    if (match) {
+        if (!etag_listed(client, match, etag)) return 0;
+    } else if (!since || parse_http_date(client, since, &date) || 
+            mtime > date) {
+        return 0;
+    }
+
+    char buffer[256];
+    int length = sprintf(buffer, "HTTP/1.1 304 Not Modified\r\n%s"
+        "%sETag: %s\r\n\r\n", connection_header(client), 
+        vary_header(content_type), etag);
+    client->status = 304;
+    client->body_bytes = 0;
+    queue_bytes(client, buffer, length);
+    return 1;
+}
+
+/*
+Checks a request's If-Range against the file's validators. Returns 1 if the 
+ranges may be used, which they may if there is no If-Range. Unlike 
+If-None-Match, a tag has to match exactly (the strong comparison), and a 
+date has to be the Last-Modified time itself.
+*/
+int if_range_holds(struct client_info* client, const char* etag, 
+        time_t mtime) {
+    struct slice* condition = find_header(client, "If-Range");
+    if (!condition) return 1;
+
+    const char* value = client->request + condition->start;
+    if (condition->length && *value == '"') {
+        return condition->length == (int) strlen(etag) && 
+            memcmp(value, etag, condition->length) == 0;
+    }
+    time_t date;
+    return !parse_http_date(client, condition, &date) && date == mtime;
+}
+
+/*
+RANGE REQUESTS
+
+A client that only wants part of a file, such as a video player seeking or 
+a download resuming where it stopped, sends a Range header:
+
+    Range: bytes=0-499          the first 500 bytes
+    Range: bytes=500-           everything from byte 500 on
+    Range: bytes=-500           the last 500 bytes
+    Range: bytes=0-0,-1         several ranges at once
+
+A single range is answered with "206 Partial Content" and a Content-Range 
+header saying which bytes follow. Several ranges are answered with one 
+multipart/byteranges body, where each part has its own little header and is 
+separated from the next by a boundary line. If none of the ranges overlap 
+the file at all, the answer is "416 Range Not Satisfiable".
+
+The selected bytes are queued straight from the cache entry or open file at 
+their offset, so a range costs no more to send than the whole file would, 
+and sendfile() still does the copying for files on disk.
+
+A Range header that doesn't parse is ignored and the whole file is sent, as 
+HTTP asks. So is one with more than MAX_RANGES ranges, or whose ranges add 
+up to more than the file itself: a client asking for the same bytes over 
+and over is cheaper to answer with one copy of them.
+*/
+#define MAX_RANGES 16
+
+struct byte_range {
+    size_t start;
+    size_t length;
+};
+
+/*
+Reads a decimal number at *p, moving *p past it. Returns -1 if there are no 
+digits, or too many to be a file offset.
+*/
+static long long parse_position(const char** p, const char* end) {
+    long long value = 0;
+    int digits = 0;
+    while (*p < end && **p >= '0' && **p <= '9') {
+        if (++digits > 18) return -1;
+        value = value * 10 + (**p - '0');
+        ++*p;
+    }
+    return digits ? value : -1;
+}
+
+/*
+Parses the Range header value [p, end) against a file of size bytes, 
+filling ranges with the satisfiable ones. Returns how many there are (0 
+means none, which calls for a 416), or -1 if the header should be ignored.
+*/
+int parse_ranges(const char* p, const char* end, size_t size, 
+        struct byte_range* ranges) {
+    if (end - p < 6 || strncasecmp(p, "bytes=", 6)) return -1;
+    p += 6;
+
+    int count = 0;
+    int seen = 0;
+    size_t total = 0;
+    while (p < end) {
+        /* Skip the whitespace and empty elements around commas. */
+        if (*p == ' ' || *p == '\t' || *p == ',') {
+            ++p;
+            continue;
+        }
+        if (++seen > MAX_RANGES) return -1;
+
+        long long first = parse_position(&p, end);
+        if (p == end || *p != '-') return -1;
+        ++p;
+        long long last = parse_position(&p, end);
+        if (p < end && *p != ',' && *p != ' ' && *p != '\t') return -1;
+
+        size_t start, stop;
+        if (first < 0) {
+            /* "-n" is the last n bytes. */
+            if (last < 0) return -1;
+            if (last == 0 || size == 0) continue;
+            start = (size_t) last < size ? size - last : 0;
+            stop = size - 1;
+        } else {
+            if (last >= 0 && last < first) return -1;
+            /* A range starting beyond the end of the file selects nothing. */
+            if ((size_t) first >= size) continue;
+            start = first;
+            stop = last < 0 || (size_t) last >= size ? size - 1 : 
+                (size_t) last;
+        }
+
+        ranges[count].start = start;
+        ranges[count].length = stop - start + 1;
+        total += ranges[count].length;
+        ++count;
+    }
+    if (!seen || total > size) return -1;
+    return count;
+}
+
+/* Queues length bytes from offset of whichever of cached or file is set. */
+static void queue_part(struct client_info* client, struct cached_file* cached, 
+        struct open_file* file, size_t offset, size_t length) {
+    if (cached) queue_cached(client, cached, offset, length);
+    else queue_file(client, file, offset, length);
+}
+
+/*
+Answers the request with part of a file, held either in the cache (cached) 
+or open on disk (file), if the request asks for that. Returns 1 if a 206 or 
+416 was queued, or 0 if the whole file should be sent as usual. Ranges only 
+apply to GET; a HEAD request always describes the whole file.
+*/
+int serve_ranges(struct client_info* client, struct cached_file* cached, 
+        struct open_file* file) {
+    if (client->head_only) return 0;
+    struct slice* header = find_header(client, "Range");
+    if (!header) return 0;
+
+    size_t size = cached ? cached->size : file->size;
+    const char* content_type = cached ? cached->content_type : 
+        file->content_type;
+    if (!if_range_holds(client, cached ? cached->etag : file->etag, 
+            cached ? cached->mtime : file->mtime)) return 0;
+    struct byte_range ranges[MAX_RANGES];
+    const char* value = client->request + header->start;
+    int count = parse_ranges(value, value + header->length, size, ranges);
+    if (count < 0) return 0;
+
+    char buffer[512];
+    int length;
+    if (count == 0) {
+        length = sprintf(buffer, "HTTP/1.1 416 Range Not Satisfiable\r\n%s"
+            "Content-Range: bytes */%lu\r\nContent-Length: 0\r\n\r\n", 
+            connection_header(client), (unsigned long) size);
+        client->status = 416;
+        client->body_bytes = 0;
+        queue_bytes(client, buffer, length);
+        return 1;
+    }
+
+    client->status = 206;
+    if (count == 1) {
+        length = sprintf(buffer, "HTTP/1.1 206 Partial Content\r\n%s"
+            "Content-Range: bytes %lu-%lu/%lu\r\n"
+            "Content-Length: %lu\r\nContent-Type: %s\r\n%s\r\n", 
+            connection_header(client), (unsigned long) ranges[0].start, 
+            (unsigned long) (ranges[0].start + ranges[0].length - 1), 
+            (unsigned long) size, (unsigned long) ranges[0].length, 
+            content_type, vary_header(content_type));
+        client->body_bytes = ranges[0].length;
+        queue_bytes(client, buffer, length);
+        queue_part(client, cached, file, ranges[0].start, ranges[0].length);
+        return 1;
+    }
+
+    /*
+    The multipart body's Content-Length has to be known before any of it is 
+    queued, so the part headers are all formatted first. The boundary only 
+    has to be a string that doesn't turn up in the file; a random-looking 
+    one is as good as it gets without scanning the whole file for it.
+    */
+    char boundary[24];
+    sprintf(boundary, "%016llx", (unsigned long long) 
+        (now_us() * 0x9e3779b97f4a7c15ull));
+
+    char parts[MAX_RANGES * 200];
+    int part_length[MAX_RANGES];
+    char* p = parts;
+    size_t body = 0;
+    int i;
+    for (i = 0; i < count; ++i) {
+        part_length[i] = sprintf(p, "\r\n--%s\r\nContent-Type: %s\r\n"
+            "Content-Range: bytes %lu-%lu/%lu\r\n\r\n", boundary, 
+            content_type, (unsigned long) ranges[i].start, 
+            (unsigned long) (ranges[i].start + ranges[i].length - 1), 
+            (unsigned long) size);
+        body += part_length[i] + ranges[i].length;
+        p += part_length[i];
+    }
+    char closing[48];
+    int closing_length = sprintf(closing, "\r\n--%s--\r\n", boundary);
+    body += closing_length;
+
+    length = sprintf(buffer, "HTTP/1.1 206 Partial Content\r\n%s"
+        "Content-Length: %lu\r\n"
+        "Content-Type: multipart/byteranges; boundary=%s\r\n%s\r\n", 
+        connection_header(client), (unsigned long) body, boundary, 
+        vary_header(content_type));
+    client->body_bytes = body;
+    queue_bytes(client, buffer, length);
+
+    p = parts;
+    for (i = 0; i < count; ++i) {
+        queue_bytes(client, p, part_length[i]);
+        queue_part(client, cached, file, ranges[i].start, ranges[i].length);
+        p += part_length[i];
+    }
+    queue_bytes(client, closing, closing_length);
+    return 1;
+}
+
+/*
+COMPRESSION
+
+Text files (HTML, CSS, JavaScript, JSON, SVG and so on) usually shrink to a 
+quarter of their size or less when compressed, so sending them compressed 
+saves most of the bytes. A client lists the compression it understands in 
+its request:
+
+    Accept-Encoding: gzip, deflate, br
+
+and the server may then send a compressed body, saying which compression it 
+used with "Content-Encoding: gzip". Both gzip and deflate (which in HTTP 
+means the zlib format) are offered, gzip first.
+
+Compressing takes far longer than sending, so it is only done once per 
+version of a file. The compressed copy is kept in the file cache as a 
+variant of the file, under the same path but a different encoding, and so 
+shares the cache's budget and LRU eviction. A variant remembers the mtime 
+of the file it was made from, and is made again once that changes. Better 
+still is a precompressed sibling: for gzip, a "public/app.js.gz" next to 
+"public/app.js" that is at least as new is used as it is, so a deploy can 
+compress at the highest level ahead of time. compress_level (--compress-level) 
+is the zlib level used for everything else, and 0 turns compressing off, 
+leaving only the siblings.
+
+Only files of at least COMPRESS_MIN_SIZE bytes are compressed, below which 
+the compression's own header eats the saving. Requests with a Range header 
+get the file itself, since ranges of a compressed body are of little use to 
+anyone. If a variant turns out no smaller than the file, or there's no way 
+to make one, an entry without data is kept to remember that, so it isn't 
+attempted on every request.
+
+Compressing is done in the event loop, and every other client of the worker 
+waits while it runs. zlib at level 6 manages roughly 20 to 100 megabytes a 
+second, depending on the processor, so a 64 KiB file takes a few 
+milliseconds but a 16 MiB one (the largest the cache would take) could 
+stall the worker for most of a second. Files are therefore only compressed 
+here up to compress_max bytes (--compress-max, COMPRESS_MAX_SIZE by 
+default). A larger file is sent as it is, unless it has a .gz sibling, 
+which only has to be read, or comes from a pack; that is the way to serve 
+big bundles compressed.
+
+zlib is the one library the server needs beyond the system's own. Built 
+with -DNO_ZLIB, nothing is compressed here, but .gz siblings are still 
+served.
+*/
+#define COMPRESS_MIN_SIZE 256
+#define COMPRESS_MAX_SIZE (64 * 1024)
+
+static int compress_level = 6;
+static size_t compress_max = COMPRESS_MAX_SIZE;
+
+/*
+Returns the encodings the request's Accept-Encoding allows, as a bit 
+(1 << ENCODING_...) for each. An encoding is allowed if it is listed, or "*" 
+is, with a quality above zero ("gzip;q=0" refuses gzip).
+*/
+int accepted_encodings(struct client_info* client) {
+    struct slice* header = find_header(client, "Accept-Encoding");
+    if (!header) return 0;
+
+    const char* p = client->request + header->start;
+    const char* end = p + header->length;
+    int allowed = 0, refused = 0, any = 0;
+    while (p < end) {
+        if (*p == ' ' || *p == '\t' || *p == ',') {
+            ++p;
+            continue;
+        }
+        const char* name = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+            ++p;
+        }
+        int name_length = p - name;
+
+        /* A quality of zero is "0", "0." or "0." followed by zeros. */
+        int zero = 0;
+        while (p < end && *p != ',') {
+            if (*p == '=' && p > name + 1 && (p[-1] | 0x20) == 'q' && 
+                    p + 1 < end && p[1] == '0') {
+                const char* q = p + 2;
+                if (q < end && *q == '.') ++q;
+                while (q < end && *q == '0') ++q;
+                zero = q == end || *q == ',' || *q == ' ' || *q == ';';
+            }
+            ++p;
+        }
+
+        int bit = 0;
+        if (name_length == 4 && strncasecmp(name, "gzip", 4) == 0) {
+            bit = 1 << ENCODING_GZIP;
+        } else if (name_length == 6 && strncasecmp(name, "x-gzip", 6) == 0) {
+            bit = 1 << ENCODING_GZIP;
+        } else if (name_length == 7 && strncasecmp(name, "deflate", 7) == 0) {
+            bit = 1 << ENCODING_DEFLATE;
+        } else if (name_length == 1 && *name == '*') {
+            if (!zero) any = 1;
+            continue;
+        }
+        if (zero) refused |= bit;
+        else allowed |= bit;
+    }
+    if (any) allowed |= (1 << ENCODING_GZIP) | (1 << ENCODING_DEFLATE);
+    return allowed & ~refused;
+}
+
+/*
+Reads the .gz sibling of the cached file source, if there is one at least 
+as new as the file. Returns the data, setting *size, or null.
+*/
+static char* read_sibling(struct cached_file* source, size_t* size) {
+    char sibling[MAX_FILE_PATH_SIZE + 4];
+    sprintf(sibling, "%s.gz", source->path);
+    int fd = open(sibling, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    char* data = 0;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && 
+            st.st_mtime >= source->mtime && st.st_size > 0 && 
+            (size_t) st.st_size < source->size) {
+        data = malloc(st.st_size);
+        size_t got = 0;
+        while (data && got < (size_t) st.st_size) {
+            ssize_t r = pread(fd, data + got, st.st_size - got, got);
+            if (r < 1) {
+                free(data);
+                data = 0;
+                break;
+            }
+            got += r;
+        }
+        *size = got;
+    }
+    close(fd);
+    return data;
+}
+
+#ifndef NO_ZLIB
+/*
+Compresses the cached file source with zlib, in the gzip or zlib ("deflate") 
+format. Returns the data, setting *size, or null. zlib picks the format from 
+windowBits: 15 is the largest window, and adding 16 asks for a gzip header 
+instead of a zlib one.
+*/
+static char* compress_file(struct cached_file* source, int encoding, 
+        size_t* size) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, compress_level, Z_DEFLATED, 
+            encoding == ENCODING_GZIP ? 15 + 16 : 15, 8, 
+            Z_DEFAULT_STRATEGY) != Z_OK) return 0;
+
+    /* deflateBound() is the most the output can possibly be. */
+    size_t bound = deflateBound(&z, source->size);
+    char* data = malloc(bound);
+    if (data) {
+        z.next_in = (Bytef*) source->data;
+        z.avail_in = source->size;
+        z.next_out = (Bytef*) data;
+        z.avail_out = bound;
+        if (deflate(&z, Z_FINISH) == Z_STREAM_END) {
+            *size = z.total_out;
+        } else {
+            free(data);
+            data = 0;
+        }
+    }
+    deflateEnd(&z);
+    return data;
+}
+#endif
+
+/*
+Makes the encoding variant of the cached file source, and caches it. Making 
+room for the variant may evict source, so the caller must hold a reference 
+to it (see serve_cached()) for as long as it uses it.
+*/
+static struct cached_file* make_variant(struct cached_file* source, 
+        int encoding) {
+    char* data = 0;
+    size_t size = 0;
+    if (encoding == ENCODING_GZIP) data = read_sibling(source, &size);
+#ifndef NO_ZLIB
+    if (!data && compress_level > 0 && source->size <= compress_max) {
+        data = compress_file(source, encoding, &size);
+    }
+#endif
+    if (data && size >= source->size) {
+        free(data);
+        data = 0;
+    }
+    if (!data) size = 0;
+
+    struct cached_file* f = calloc(1, sizeof(*f) + strlen(source->path) + 1);
+    if (!f) {
+        free(data);
+        return 0;
+    }
+    f->path = (char*) (f + 1);
+    strcpy(f->path, source->path);
+    f->hash = source->hash;
+    f->encoding = encoding;
+    f->data = data;
+    f->size = size;
+    f->content_type = source->content_type;
+    /* The variant's tag is the file's, marked with the encoding. */
+    sprintf(f->etag, "%.*s-%s\"", (int) strlen(source->etag) - 1, 
+        source->etag, encoding_names[encoding]);
+    f->header_length = format_file_header(f->header, f->etag, 
+        f->content_type, encoding_names[encoding], size, source->mtime);
+    f->mtime = source->mtime;
+    f->checked = time(0);
+    cache_insert(f);
+    return f;
+}
+
+/*
+Returns the compressed variant of the cached file f to send the client, or 
+null if the file itself should be sent.
+*/
+struct cached_file* compressed_variant(struct cached_file* f, 
+        struct client_info* client) {
+    if (!is_compressible(f->content_type) || f->size < COMPRESS_MIN_SIZE || 
+        find_header(client, "Range")) return 0;
+
+    int accepted = accepted_encodings(client);
+    /* A packed file has only the gzip body packed with it, if any. */
+    if (f->packed) {
+        return accepted & (1 << ENCODING_GZIP) ? f->packed_gzip : 0;
+    }
+    int encoding;
+    if (accepted & (1 << ENCODING_GZIP)) encoding = ENCODING_GZIP;
+    else if (accepted & (1 << ENCODING_DEFLATE)) encoding = ENCODING_DEFLATE;
+    else return 0;
+
+    struct cached_file* variant = cache_find(f->path, encoding);
+    if (variant && variant->mtime != f->mtime) {
+        cache_remove(variant);
+        variant = 0;
+    }
+    if (!variant) variant = make_variant(f, encoding);
+    if (!variant || !variant->data) return 0;
+    return variant;
+}
+
+/* Sends a cached file, whose header lines were prepared when it was loaded. */
+static void send_cached(struct client_info* client, struct cached_file* f) {
+    /*
+    A client whose copy is current gets a 304, and a request for part of 
+    the file is answered by serve_ranges().
+    */
+    if (serve_not_modified(client, f->etag, f->mtime, f->content_type)) {
+        return;
+    }
+    if (serve_ranges(client, f, 0)) return;
+
+    char header[512];
+    int header_length = sprintf(header, "HTTP/1.1 200 OK\r\n%s%s\r\n", 
+        connection_header(client), f->header);
+
+    client->status = 200;
+    client->body_bytes = client->head_only ? 0 : f->size;
+
+    /* The body is queued by reference and leaves with the header. */
+    queue_bytes(client, header, header_length);
+    if (!client->head_only) queue_cached(client, f, 0, f->size);
+}
+
+/*
+Sends a cached file, or a compressed copy of it if the client takes one. 
+Making the copy may evict f from the cache to make room, so f is held 
+until the response is queued, which takes references of its own.
+*/
+void serve_cached(struct client_info* client, struct cached_file* f) {
+    if (!f->packed) ++f->refs;
+    struct cached_file* variant = compressed_variant(f, client);
+    send_cached(client, variant ? variant : f);
+    if (!f->packed) cache_release(f);
+}
+
+/*
+PACKS
+
+For an immutable deploy, public/ can be packed into a single archive with 
+web_pack (see web_pack.c and pack.h), and the server started with 
+--pack FILE serves from that instead of from the directory. The archive is 
+mapped into memory once at startup and shared by all the workers. It holds 
+a sorted index of the paths, so finding a file is a binary search in 
+memory, along with each file's header lines and optionally a gzip body, 
+worked out when the archive was built. Answering a request for a packed 
+file therefore takes no system calls besides sending the response: no 
+open(), no stat() and no reading.
+
+At startup each entry gets a cached_file of its own, pointing into the 
+mapped archive, so everything that works for cached files (ranges, 
+conditional requests, compressed variants) works for packed ones too. 
+Packed entries are never evicted and never change, so they aren't reference 
+counted: they are shared between the workers, and counting would have 
+every worker writing to the same memory. Replacing the pack means 
+restarting the server.
+*/
+struct pack {
+    char* map;
+    size_t size;
+    const struct pack_entry* entries;
+    uint32_t count;
+    const char* strings;
+    struct cached_file* files;
+    struct cached_file* gzip_files;
+};
+static struct pack pack;
+
+/* Copies the archive string at offset into out, of size out_size. */
+static int pack_string(char* out, size_t out_size, uint32_t offset) {
+    size_t length = strlen(pack.strings + offset);
+    if (length >= out_size) return -1;
+    memcpy(out, pack.strings + offset, length + 1);
+    return length;
+}
+
+/*
+Fills in f for one body of a packed entry. Returns -1 if the entry doesn't 
+fit in a cached_file.
+*/
+static int pack_fill(struct cached_file* f, const struct pack_entry* e, 
+        uint64_t body, uint64_t length, uint32_t etag, uint32_t header) {
+    f->data = pack.map + body;
+    f->size = length;
+    f->content_type = pack.strings + e->content_type;
+    f->mtime = e->mtime;
+    f->packed = 1;
+    f->refs = 1;
+    f->header_length = pack_string(f->header, sizeof(f->header), header);
+    if (f->header_length < 0 || 
+            pack_string(f->etag, sizeof(f->etag), etag) < 0) return -1;
+    return 0;
+}
+
+/* Maps the archive at path and checks it. Exits if it can't be used. */
+void pack_open(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "ERROR: Can't open pack %s. (%d)\n", path, errno);
+        exit(1);
+    }
+    pack.size = st.st_size;
+    pack.map = pack.size ? 
+        mmap(0, pack.size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (pack.map == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Can't map pack %s. (%d)\n", path, errno);
+        exit(1);
+    }
+
+    /*
+    Check everything the server will rely on, so a damaged or truncated 
+    archive is refused now instead of crashing a worker later.
+    */
+    const struct pack_header* h = (const struct pack_header*) pack.map;
+    int valid = pack.size >= sizeof(*h) && 
+        memcmp(h->magic, PACK_MAGIC, 8) == 0 && 
+        h->strings == sizeof(*h) + 
+            (uint64_t) h->count * sizeof(struct pack_entry) && 
+        h->strings_length > 0 && 
+        h->strings + h->strings_length <= pack.size && 
+        pack.map[h->strings + h->strings_length - 1] == 0;
+    if (valid) {
+        pack.count = h->count;
+        pack.entries = (const struct pack_entry*) (pack.map + sizeof(*h));
+        pack.strings = pack.map + h->strings;
+        pack.files = calloc(pack.count, sizeof(struct cached_file));
+        pack.gzip_files = calloc(pack.count, sizeof(struct cached_file));
+        if (!pack.files || !pack.gzip_files) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(1);
+        }
+    }
+
+    uint32_t i;
+    for (i = 0; valid && i < pack.count; ++i) {
+        const struct pack_entry* e = &pack.entries[i];
+        valid = e->path < h->strings_length && 
+            e->content_type < h->strings_length && 
+            e->etag < h->strings_length && e->header < h->strings_length && 
+            e->gzip_etag < h->strings_length && 
+            e->gzip_header < h->strings_length && 
+            e->body <= pack.size && e->body_length <= pack.size - e->body && 
+            e->gzip_body <= pack.size && 
+            e->gzip_length <= pack.size - e->gzip_body && 
+            (i == 0 || strcmp(pack.strings + pack.entries[i - 1].path, 
+                pack.strings + e->path) < 0) && 
+            !pack_fill(&pack.files[i], e, e->body, e->body_length, e->etag, 
+                e->header);
+        if (valid && e->gzip_header) {
+            valid = !pack_fill(&pack.gzip_files[i], e, e->gzip_body, 
+                e->gzip_length, e->gzip_etag, e->gzip_header);
+            pack.files[i].packed_gzip = &pack.gzip_files[i];
+        }
+    }
+    if (!valid) {
+        fprintf(stderr, "ERROR: %s is not a usable pack.\n", path);
+        exit(1);
+    }
+    printf("Serving %u files from pack %s.\n", pack.count, path);
+}
+
+/* Answers a request for path from the pack. */
+void serve_packed(struct client_info* client, const char* path) {
+    char key[MAX_PATH_SIZE + 1];
+    normalize_path(key, path);
+    int i = pack_find(pack.entries, pack.count, pack.strings, key);
+    if (i < 0) {
+        send_404(client);
+        return;
+    }
+    serve_cached(client, &pack.files[i]);
+}
+
+void serve_resource(struct client_info* client, const char* path) {
+    /* Serve a default file if the client requests "/" */
+    if (strcmp(path, "/") == 0) path = "/index.html";
+
+    /* Check for double dots ".." to avoid access of forbidden resources. */
+    if (strstr(path, "..")) {
+        send_404(client);
+        return;
+    }
+
+    /* With a pack, public/ itself is never looked at. */
+    if (pack.map) {
+        serve_packed(client, path);
+        return;
+    }
+
+    /* Full path to the resource, which is also its key in the file cache. */
+    char raw_path[MAX_FILE_PATH_SIZE + 1];
+    sprintf(raw_path, "public%s", path);
+    char full_path[MAX_FILE_PATH_SIZE + 1];
+    normalize_path(full_path, raw_path);
+
+    /*
+    Unix based systems use slashes ("/") to separate directories, while 
+    Windows based systems use a backslash ("\"). Here, we walk the path string 
+    and replace the slashes appropriately. Note that a double backslash is 
+    used in this code, since C interprets the first backslash as escaping the 
+    second backslash.
+
+    Many Windows functions handle this automatically, but we do it manually 
+    for peace of mind.
+     */
+#if defined(_WIN32)
+    char *p = full_path;
+    while (*p) {
+        if (p == '/') *p = '\\';
+        ++p;
+    }
+#endif
+
+    /*
+    A file that is already cached is sent straight from memory, without 
+    touching the filesystem at all.
+    */
+    struct cached_file* cached = cache_find(full_path, ENCODING_IDENTITY);
+    if (cached) {
+        serve_cached(client, cached);
+        return;
+    }
+
+    /* Otherwise find the file among those already open, or open it. */
+    struct open_file* file = open_file_get(full_path);
+    if (!file) {
+        if (verbose) fprintf(stderr, "ERROR: Issue accessing resource.\n");
+        send_404(client);
+        return;
+    }
+
+    /*
+    Try to keep a copy for next time. Files too large for the cache are sent 
+    from disk as before.
+    */
+    cached = cache_load(full_path, file->fd, file->size, file->mtime, 
+        file->inode);
+    if (cached) {
+        open_file_release(file);
+        serve_cached(client, cached);
+        return;
+    }
+
+    if (serve_not_modified(client, file->etag, file->mtime, 
+            file->content_type) || 
+            serve_ranges(client, 0, file)) {
+        open_file_release(file);
+        return;
+    }
+
+    /*
+    The whole header is assembled in one buffer, from the header lines kept 
+    with the open file. Note it ends with a blank line (\r\n) to delinate 
+    the header and body.
+    */
+# define BSIZE 1024
+    char buffer[BSIZE];
+    int header_length = sprintf(buffer, "HTTP/1.1 200 OK\r\n%s%s\r\n", 
+        connection_header(client), file->header);
+
+    /*
+    Queue the body straight from the file, without copying it ourselves. The 
+    queued chunk holds its own reference on the open file until it has been 
+    sent.
+    */
+    client->status = 200;
+    client->body_bytes = client->head_only ? 0 : file->size;
+    queue_bytes(client, buffer, header_length);
+    if (!client->head_only) queue_file(client, file, 0, file->size);
+    open_file_release(file);
+}
+
+/*
+Decides whether the connection should stay open after answering the parsed 
+request. HTTP/1.1 connections are persistent unless the client sends 
+"Connection: close", while HTTP/1.0 connections close unless the client asks 
+for "Connection: keep-alive".
+*/
+int wants_keep_alive(struct client_info* client) {
+    int keep_alive = !slice_is(client, client->in->parser.version, "HTTP/1.0");
+
+    struct slice* connection = find_header(client, "Connection");
+    if (connection) {
+        char value[64];
+        int length = connection->length;
+        if (length > (int) sizeof(value) - 1) length = sizeof(value) - 1;
+        memcpy(value, client->request + connection->start, length);
+        value[length] = 0;
+
+        if (strcasestr(value, "close")) keep_alive = 0;
+        else if (strcasestr(value, "keep-alive")) keep_alive = 1;
+    }
+    return keep_alive;
+}
+
+/*
+ROUTES
+
+Every request is dispatched by the router (see router.h) to a handler 
+registered for its method and path. Serving files from public/ (or a pack) 
+is just one handler, registered for "/" followed by a "*path" capture so 
+that it takes every path no other route claims. The others answer from inside the server:
+
+    /health             "ok", for load balancers and monitoring to poll
+    /time               the local time, like chapter 2's time_server
+    /time/:format       the time as "unix" seconds, "iso" 8601 or "json"
+    /__stats            the server's statistics (see METRICS)
+
+A path that matches a route registered only for other methods gets a 405 
+listing the ones it has; one that matches nothing gets a 404.
+*/
+static struct router router;
+
+static void route_static(void* context, struct route_match* match) {
+    serve_resource((struct client_info*) context, match->path);
+}
+
+static void route_health(void* context, struct route_match* match) {
+    (void) match;
+    serve_dynamic((struct client_info*) context, "text/plain", "ok\n", 3);
+}
+
+static void route_stats(void* context, struct route_match* match) {
+    struct client_info* client = (struct client_info*) context;
+    (void) match;
+    serve_stats(client, slice_is(client, client->in->parser.query, 
+        "format=json"));
+}
+
+static void route_time(void* context, struct route_match* match) {
+    struct client_info* client = (struct client_info*) context;
+    time_t timer;
+    time(&timer);
+
+    char iso[32];
+    struct tm tm;
+    gmtime_r(&timer, &tm);
+    strftime(iso, sizeof(iso), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+    char body[128];
+    int length;
+    int format_length;
+    const char* format = route_param(match, "format", &format_length);
+    if (!format) {
+        /* ctime_r() is ctime() without the shared buffer, for threads. */
+        char local[32];
+        length = sprintf(body, "Local time is %s", ctime_r(&timer, local));
+    } else if (format_length == 4 && memcmp(format, "unix", 4) == 0) {
+        length = sprintf(body, "%ld\n", (long) timer);
+    } else if (format_length == 3 && memcmp(format, "iso", 3) == 0) {
+        length = sprintf(body, "%s\n", iso);
+    } else if (format_length == 4 && memcmp(format, "json", 4) == 0) {
+        length = sprintf(body, "{\"unix\":%ld,\"iso\":\"%s\"}\n", 
+            (long) timer, iso);
+        serve_dynamic(client, "application/json", body, length);
+        return;
+    } else {
+        send_404(client);
+        return;
+    }
+    serve_dynamic(client, "text/plain", body, length);
+}
+
+/* Registers the routes above. Called once, before the workers start. */
+void routes_init() {
+    if (router_add(&router, "GET", "/health", route_health) || 
+        router_add(&router, "GET", "/time", route_time) || 
+        router_add(&router, "GET", "/time/:format", route_time) || 
+        router_add(&router, "GET", "/__stats", route_stats) || 
+        router_add(&router, "GET", "/*path", route_static)) {
+        fprintf(stderr, "ERROR: Invalid route.\n");
+        exit(1);
+    }
+}
+
+/* Dispatches a request for the (decoded) path to its handler. */
+void route_request(struct client_info* client, int method, const char* path) {
+    struct route_match match;
+    route_handler handler = router_match(&router, method, path, 
+        strlen(path), &match);
+    if (handler) handler(client, &match);
+    else if (match.allowed) send_405(client, match.allowed);
+    else send_404(client);
+}
+
+/*
+Answers the first complete request in the client's buffer, queuing its 
+response. With keep-alive, a client may send several requests back to back 
+(pipelining) without waiting for the responses, so any bytes that follow 
+the request are moved to the front of the buffer afterwards. Returns 0 if 
+the buffer doesn't hold a complete request yet.
+*/
+int handle_request(struct client_info* client) {
+    if (!client->in) return 0;
+    struct http_request* req = &client->in->parser;
+    int parsed = parse_request(req, client->request, client->received);
+    if (parsed == 0) return 0;
+
+    ++client->requests_served;
+    ++self->stats.requests;
+
+    /*
+    There's no telling where a malformed request ends, so everything 
+    buffered is thrown away and the connection closed after the 400.
+    */
+    if (parsed < 0) {
+        send_400(client);
+        count_response(client);
+        access_log(client);
+        client->closing = 1;
+        client->received = 0;
+        request_release(client);
+        return 1;
+    }
+
+    client->keep_alive = wants_keep_alive(client) && 
+        client->requests_served < max_requests;
+    client->head_only = slice_is(client, req->method, "HEAD");
+    int method = route_method(client->request + req->method.start, 
+        req->method.length);
+
+    int limited = !ip_take_token(client->ip);
+
+    /* The query string is whatever follows the first "?" of the target. */
+    const char* target = client->request + req->target.start;
+    const char* question = memchr(target, '?', req->target.length);
+    int path_length = question ? question - target : req->target.length;
+    req->path = make_slice(req->target.start, 
+        req->target.start + path_length);
+    req->query = make_slice(req->path.start + path_length + !!question, 
+        req->target.start + req->target.length);
+
+    /*
+    The method must be one the router knows, paths must start with a slash 
+    (and fit in path) and the version must be HTTP/1.x.
+    */
+    char path[MAX_PATH_SIZE + 1];
+    if (limited) {
+        ++self->stats.limited;
+        send_429(client);
+    } else if (method < 0 || *target != '/' || path_length > MAX_PATH_SIZE || 
+        req->version.length != 8 || 
+        strncmp(client->request + req->version.start, "HTTP/1.", 7) || 
+        percent_decode(path, target, path_length) < 0) {
+        send_400(client);
+    } else {
+        route_request(client, method, path);
+    }
+    count_response(client);
+    access_log(client);
+
+    if (!client->keep_alive) client->closing = 1;
+
+    /* Keep whatever followed this request, including the terminator. */
+    memmove(client->request, client->request + req->length, 
+        client->received - req->length + 1);
+    client->received -= req->length;
+    client->request_started = 0;
+    parser_reset(req);
+
+    /* Nothing more buffered, so the buffer can go back to the pool. */
+    request_release(client);
+    return 1;
+}
+
+/*
+Moves a connection along as far as it can go without blocking: answers the 
+requests already buffered, writes out queued responses, and reads more from 
+the socket. Called whenever epoll reports the client readable or writable.
+
+Being edge-triggered, we are only told once that something changed, so we 
+keep going until the socket has no more data for us (EAGAIN), its send 
+buffer is full, or the client has been dropped.
+*/
+void service_client(struct client_info* client) {
+    while (1) {
+        /*
+        Answer buffered requests, but stop while too much output is already 
+        queued. This is the backpressure: further requests (and the socket 
+        behind them) are left alone until the client catches up.
+        */
+        while (!client->closing && client->out_bytes <= max_queued && 
+            handle_request(client));
+        int stalled = client->out_bytes > max_queued;
+
+        int flushed = flush_client(client);
+        if (flushed < 0) {
+            drop_client(client);
+            return;
+        }
+        if (client->closing) {
+            if (flushed == 0) drop_client(client);
+            else update_timer(client);
+            return;
+        }
+
+        /* Still too much queued; EPOLLOUT will bring us back here. */
+        if (client->out_bytes > max_queued) {
+            update_timer(client);
+            return;
+        }
+        /* The flush made room, so see whether more requests are buffered. */
+        if (stalled) continue;
+
+        /*
+        Make sure there is room in the client's request buffer, attaching or 
+        growing one as needed. A request whose header has grown past 
+        max_header_bytes without ending is refused.
+        */
+        int room = request_reserve(client, 1);
+        if (room == 0) {
+            send_431(client);
+            count_response(client);
+            access_log(client);
+            client->closing = 1;
+            continue;
+        }
+
+        /* Receive data into the free end of the buffer. */
+        int r = recv(client->socket, 
+            client->request + client->received, room, 0);
+
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* Nothing came, so an empty buffer goes straight back. */
+            request_release(client);
+            update_timer(client);
+            return;
+        }
+        if (r < 0 && errno == EINTR) continue;
+
+        /*
+        Sudden client disconnects warrant memory cleanup. Successful data 
+        writes are finalized with a null terminator added to the end of that 
+        client's data buffer.
+        */
+        if (r < 1) {
+            if (verbose) printf("Unexpected disconnect from %s.\n", 
+                get_client_address(client));
+            drop_client(client);
+            return;
+        }
+
+        client->received += r;
+        client->request[client->received] = 0;
+    }
+}
+
+/*
+WORKERS
+
+A single event loop only ever uses one CPU core. To use more, the server runs 
+several workers, each a thread with its own listening socket, epoll instance, 
+client pool, client table and file cache. Nothing is shared between them, so 
+they never wait on each other for a lock.
+
+All the listening sockets are bound to the same port with SO_REUSEPORT, and 
+the kernel spreads incoming connections across them. Workers may optionally 
+be pinned to one CPU each, which keeps a worker's data in that core's caches.
+
+Each worker counts its own activity in its worker_stats (declared with the 
+client list above). The counters are added up and reported when the server 
+stops.
+*/
+static int pin_workers = 0;
+static int max_clients = 1024;
+static size_t cache_bytes = 64 * 1024 * 1024;
+
+/*
+Set once the server has been asked to stop. stop_fd is an eventfd that every 
+worker watches; writing to it wakes them all so they notice.
+*/
+static volatile sig_atomic_t running = 1;
+static int stop_fd = -1;
+
+/* The readiness-based event loop, built on epoll. */
+void epoll_loop(SOCKET server) {
+    /*
+    Create the epoll instance and register the listening socket with it. The 
+    listener is identified by a null data pointer, the file cache's inotify 
+    descriptor by a pointer to the cache and the stop eventfd by a pointer to 
+    stop_fd, since every client registration points at its client_info.
+    */
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        fprintf(stderr, "ERROR: epoll_create1() failed. (%d)\n", 
+            GETSOCKETERRNO());
+        exit(1);
+    }
+
+    set_nonblocking(server);
+    struct epoll_event server_event;
+    memset(&server_event, 0, sizeof(server_event));
+    server_event.events = EPOLLIN | EPOLLET;
+    server_event.data.ptr = 0;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server, &server_event)) {
+        fprintf(stderr, "ERROR: epoll_ctl() failed. (%d)\n", 
+            GETSOCKETERRNO());
+        exit(1);
+    }
+
+    if (cache.inotify_fd >= 0) {
+        struct epoll_event cache_event;
+        memset(&cache_event, 0, sizeof(cache_event));
+        cache_event.events = EPOLLIN | EPOLLET;
+        cache_event.data.ptr = &cache;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, cache.inotify_fd, &cache_event);
+    }
+
+    /*
+    The stop eventfd is level-triggered and never read, so once it is 
+    written every worker keeps being woken until it has left its loop.
+    */
+    struct epoll_event stop_event;
+    memset(&stop_event, 0, sizeof(stop_event));
+    stop_event.events = EPOLLIN;
+    stop_event.data.ptr = &stop_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, stop_fd, &stop_event);
+
+#define MAX_EVENTS 256
+    struct epoll_event events[MAX_EVENTS];
+
+    /* The loop listens until the server is asked to stop with a signal. */
+    while (running) {
+        /* Sleep no longer than until the nearest deadline. */
+        int ready = wait_on_clients(epfd, events, MAX_EVENTS, 
+            wheel_timeout());
+        loop_ms = now_ms();
+
+        int e;
+        for (e = 0; e < ready; ++e) {
+            /*
+            An event on the server socket indicates one or more incoming 
+            client connections. Since the listener is edge-triggered, keep 
+            accepting until accept() reports that no connections are left. 
+            accept4() hands the new socket back already non-blocking (and 
+            close-on-exec), saving a separate fcntl() for each connection.
+            */
+            if (events[e].data.ptr == 0) {
+                int batch = 0;
+                while (1) {
+                    struct sockaddr_storage address;
+                    socklen_t address_length = sizeof(address);
+                    SOCKET s = accept4(server, (struct sockaddr*) &address, 
+                        &address_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+                    if (!ISVALIDSOCKET(s)) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && 
+                            errno != EINTR) {
+                            fprintf(stderr, "ERROR: Issue with accept(). "
+                                "(%d)\n", GETSOCKETERRNO());
+                        }
+                        if (errno == EINTR) continue;
+                        break;
+                    }
+
+                    ++batch;
+                    struct client_info* client = admit_client(s, &address, 
+                        address_length);
+                    if (!client) continue;
+
+                    if (watch_client(epfd, client)) {
+                        fprintf(stderr, "ERROR: epoll_ctl() failed. (%d)\n", 
+                            GETSOCKETERRNO());
+                        drop_client(client);
+                        continue;
+                    }
+                    update_timer(client);
+                }
+                if (batch) hist_record(&self->stats.accept_batch, batch);
+                continue;
+            }
+
+            /* Files in public/ changed; drop their cached copies. */
+            if (events[e].data.ptr == &cache) {
+                cache_handle_events();
+                continue;
+            }
+
+            /* The server is stopping; running is already 0. */
+            if (events[e].data.ptr == &stop_fd) continue;
+
+            /*
+            Otherwise the event belongs to an already connected client, which 
+            the kernel hands back to us directly through the data pointer.
+            */
+            struct client_info* client = events[e].data.ptr;
+            service_client(client);
+        }
+
+        wheel_advance(client_timed_out);
+    }
+
+    close(epfd);
+}
+
+/*
+IO_URING
+
+io_uring is an alternative to waiting for readiness with epoll and then 
+making a system call for each accept, recv or send. The program and the 
+kernel share two ring buffers: operations are placed on the submission 
+queue, and the kernel puts their results on the completion queue. A single 
+io_uring_enter() call both submits everything queued since the last one and 
+waits for completions, so a busy worker makes far fewer system calls.
+
+The engine is selected with --io-uring. It needs a kernel from 5.19 onwards 
+for multishot accept and provided buffer rings; if setting those up fails 
+the worker falls back to the epoll loop above.
+
+Since liburing isn't assumed to be installed, the rings are set up with the 
+raw system calls here. The operations used are:
+
+  * One multishot accept on the listening socket, which keeps producing a 
+    completion for every new connection without being resubmitted.
+  * A recv per client that doesn't name a buffer. The kernel picks one from 
+    a ring of buffers we provide, only once data has actually arrived, so 
+    idle connections don't each tie up a buffer. The data is copied into 
+    the client's request buffer and the buffer handed straight back.
+  * A chain of linked sends for the client's output queue, one per queued 
+    chunk. Linked operations run one after another, so a whole response 
+    goes out with one submission. File chunks are read from public/ by a 
+    read on the same ring, linked in front of the send of that data.
+  * Polls on the inotify descriptor and the stop eventfd.
+
+Every operation carries a user_data value that comes back with its 
+completion. Ours is the client_info pointer with the kind of operation in 
+its low three bits, which are always zero in the pointer itself.
+*/
+#define URING_ENTRIES 256
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE 2048
+#define URING_BUFFER_GROUP 0
+#define URING_STAGE_SIZE (64 * 1024)
+#define URING_MAX_CHAIN 16
+
+enum { URING_ACCEPT, URING_RECV, URING_SEND, URING_READ, URING_SEND_STAGED, 
+    URING_CACHE, URING_STOP };
+
+struct uring {
+    int fd;
+    /* Submission queue, shared with the kernel. */
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe* sqes;
+    /* Operations prepared but not yet made visible to the kernel. */
+    unsigned sqe_tail;
+    /* Completion queue, shared with the kernel. */
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    void* ring_memory;
+    size_t ring_size;
+    size_t sqes_size;
+    /* The provided buffers that recv picks from. */
+    struct io_uring_buf_ring* buffers;
+    char* buffer_memory;
+};
+static __thread struct uring ring;
+
+static int use_io_uring = 0;
+
+int uring_init() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring.fd < 0) return -1;
+
+    /*
+    The submission and completion rings share one mapping on any kernel 
+    with IORING_FEAT_SINGLE_MMAP (5.4), which everything else here needs 
+    anyway; so is IORING_FEAT_EXT_ARG (5.11), used for timeouts. The 
+    submission entries themselves are mapped separately.
+    */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || 
+        !(params.features & IORING_FEAT_EXT_ARG)) {
+        close(ring.fd);
+        return -1;
+    }
+    size_t sq_size = params.sq_off.array + 
+        params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + 
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    ring.ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring.ring_memory = mmap(0, ring.ring_size, PROT_READ | PROT_WRITE, 
+        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.ring_memory == MAP_FAILED) {
+        close(ring.fd);
+        return -1;
+    }
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = (struct io_uring_sqe*) mmap(0, ring.sqes_size, 
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, 
+        IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        munmap(ring.ring_memory, ring.ring_size);
+        close(ring.fd);
+        return -1;
+    }
+
+    char* base = (char*) ring.ring_memory;
+    ring.sq_head = (unsigned*) (base + params.sq_off.head);
+    ring.sq_tail = (unsigned*) (base + params.sq_off.tail);
+    ring.sq_mask = *(unsigned*) (base + params.sq_off.ring_mask);
+    ring.sq_entries = params.sq_entries;
+    ring.sqe_tail = *ring.sq_tail;
+    ring.cq_head = (unsigned*) (base + params.cq_off.head);
+    ring.cq_tail = (unsigned*) (base + params.cq_off.tail);
+    ring.cq_mask = *(unsigned*) (base + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*) (base + params.cq_off.cqes);
+
+    /* Slot i of the submission ring always holds entry i. */
+    unsigned* array = (unsigned*) (base + params.sq_off.array);
+    unsigned i;
+    for (i = 0; i < params.sq_entries; ++i) array[i] = i;
+
+    return 0;
+}
+
+void uring_close() {
+    munmap(ring.sqes, ring.sqes_size);
+    munmap(ring.ring_memory, ring.ring_size);
+    close(ring.fd);
+    if (ring.buffers) {
+        munmap(ring.buffers, URING_BUFFERS * sizeof(struct io_uring_buf));
+    }
+    free(ring.buffer_memory);
+    memset(&ring, 0, sizeof(ring));
+}
+
+/*
+Hands the kernel everything prepared so far and, if wait is set, sleeps 
+until at least one completion is available or timeout_ms milliseconds have 
+passed (-1 for no limit). The timeout is passed through the extended 
+argument of io_uring_enter() (IORING_ENTER_EXT_ARG, kernel 5.11).
+*/
+int uring_submit(int wait, int timeout_ms) {
+    unsigned to_submit = ring.sqe_tail - *ring.sq_tail;
+    __atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    unsigned flags = 0;
+    if (wait) {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            arg.ts = (uintptr_t) &ts;
+        }
+    }
+
+    int r;
+    do {
+        r = syscall(__NR_io_uring_enter, ring.fd, to_submit, wait ? 1 : 0, 
+            flags, wait ? &arg : 0, sizeof(arg));
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+/*
+Makes sure count entries can be prepared without the submission queue 
+filling up, so that a linked chain is never split between submissions.
+*/
+void uring_reserve(unsigned count) {
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    if (ring.sqe_tail - head + count > ring.sq_entries) uring_submit(0, 0);
+}
+
+struct io_uring_sqe* uring_sqe(int op, void* ptr) {
+    uring_reserve(1);
+    struct io_uring_sqe* sqe = &ring.sqes[ring.sqe_tail & ring.sq_mask];
+    ++ring.sqe_tail;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t) (uintptr_t) ptr | op;
+    return sqe;
+}
+
+/* Returns buffer bid to the ring that recv picks buffers from. */
+void uring_recycle(int bid) {
+    unsigned short tail = ring.buffers->tail;
+    struct io_uring_buf* b = &ring.buffers->bufs[tail & (URING_BUFFERS - 1)];
+    b->addr = (uintptr_t) (ring.buffer_memory + bid * URING_BUFFER_SIZE);
+    b->len = URING_BUFFER_SIZE;
+    b->bid = bid;
+    __atomic_store_n(&ring.buffers->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+int uring_setup_buffers() {
+    ring.buffers = (struct io_uring_buf_ring*) mmap(0, 
+        URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, 
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.buffers == MAP_FAILED) {
+        ring.buffers = 0;
+        return -1;
+    }
+    ring.buffer_memory = (char*) malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+    if (!ring.buffer_memory) return -1;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t) ring.buffers;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, 
+            &reg, 1)) {
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < URING_BUFFERS; ++i) uring_recycle(i);
+    return 0;
+}
+
+void uring_arm_accept(SOCKET server) {
+    struct io_uring_sqe* sqe = uring_sqe(URING_ACCEPT, 0);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+void uring_arm_poll(int fd, int op, int multishot) {
+    struct io_uring_sqe* sqe = uring_sqe(op, 0);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    if (multishot) sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+void uring_arm_recv(struct client_info* client) {
+    struct io_uring_sqe* sqe = uring_sqe(URING_RECV, client);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->socket;
+    /*
+    Never take more than the request may still grow by. The data lands in 
+    one of the ring's buffers and is copied into the client's own request 
+    buffer when the recv completes, so none needs to be attached yet.
+    */
+    sqe->len = max_header_bytes - client->received;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    client->recv_armed = 1;
+}
+
+/*
+Submits the front of the client's queue as one linked chain, unless a 
+chain is still in flight. Chunks are only retired as their sends complete, 
+so the memory the kernel is reading from stays valid until then.
+
+MSG_WAITALL makes the kernel keep sending until a chunk is gone, so a send 
+that comes up short means the connection failed, which also cancels the 
+rest of the chain.
+*/
+void uring_flush(struct client_info* client) {
+    if (client->chain_left || !client->out_head) return;
+    uring_reserve(URING_MAX_CHAIN);
+
+    struct io_uring_sqe* last = 0;
+    struct io_uring_sqe* sqe;
+    int count = 0;
+    struct out_chunk* c;
+    for (c = client->out_head; c && count < URING_MAX_CHAIN - 1; 
+            c = c->next) {
+        if (last) last->flags |= IOSQE_IO_LINK;
+
+        if (c->kind == CHUNK_MEMORY) {
+            sqe = uring_sqe(URING_SEND, client);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = client->socket;
+            sqe->addr = (uintptr_t) c->data;
+            sqe->len = c->length;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | 
+                (c->next ? MSG_MORE : 0);
+            last = sqe;
+            ++count;
+            continue;
+        }
+
+        /*
+        A file chunk is read into the client's stage buffer and sent from 
+        there. The stage is reused for each piece, so the chain ends here.
+        */
+        if (!client->stage) {
+            client->stage = (char*) malloc(URING_STAGE_SIZE);
+            if (!client->stage) {
+                fprintf(stderr, "ERROR: Out of memory.\n");
+                exit(1);
+            }
+        }
+        size_t length = c->length < URING_STAGE_SIZE ? 
+            c->length : URING_STAGE_SIZE;
+
+        sqe = uring_sqe(URING_READ, client);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = c->fd;
+        sqe->addr = (uintptr_t) client->stage;
+        sqe->len = length;
+        sqe->off = c->offset;
+        sqe->flags = IOSQE_IO_LINK;
+
+        sqe = uring_sqe(URING_SEND_STAGED, client);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = client->socket;
+        sqe->addr = (uintptr_t) client->stage;
+        sqe->len = length;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | 
+            (length < c->length || c->next ? MSG_MORE : 0);
+        count += 2;
+        break;
+    }
+
+    client->chain_left = count;
+    client->chain_failed = 0;
+}
+
+/*
+The io_uring counterpart of service_client(): answers buffered requests, 
+submits output, and asks for more input once there is room for it.
+*/
+void uring_service(struct client_info* client) {
+    while (!client->closing && client->out_bytes <= max_queued && 
+        handle_request(client));
+
+    uring_flush(client);
+
+    if (client->closing) {
+        if (!client->out_head) drop_client(client);
+        else update_timer(client);
+        return;
+    }
+
+    /*
+    While too much output is queued, no new recv is submitted; the next 
+    completed send chain brings us back here.
+    */
+    if (client->out_bytes <= max_queued && !client->recv_armed) {
+        if (client->received >= max_header_bytes) {
+            send_431(client);
+            count_response(client);
+            access_log(client);
+            client->closing = 1;
+            uring_flush(client);
+        } else {
+            uring_arm_recv(client);
+        }
+    }
+    update_timer(client);
+}
+
+void uring_accepted(SOCKET s) {
+    /* Multishot accept can't return addresses, so ask for it. */
+    struct sockaddr_storage address;
+    socklen_t address_length = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    getpeername(s, (struct sockaddr*) &address, &address_length);
+
+    struct client_info* client = admit_client(s, &address, address_length);
+    if (!client) return;
+    uring_arm_recv(client);
+    update_timer(client);
+}
+
+/* Handles a completion that belongs to a client. */
+void uring_complete(struct client_info* client, int op, int res, 
+        unsigned flags) {
+    if (op == URING_RECV) {
+        client->recv_armed = 0;
+        if (flags & IORING_CQE_F_BUFFER) {
+            int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            if (res > 0 && !client->dropping) {
+                request_reserve(client, res);
+                memcpy(client->request + client->received, 
+                    ring.buffer_memory + bid * URING_BUFFER_SIZE, res);
+                client->received += res;
+                client->request[client->received] = 0;
+            }
+            uring_recycle(bid);
+        }
+        if (!client->dropping) {
+            if (res == -ENOBUFS) {
+                /* Every buffer was in use; try again. */
+                uring_service(client);
+            } else if (res < 1) {
+                if (verbose) printf("Unexpected disconnect from %s.\n", 
+                    get_client_address(client));
+                drop_client(client);
+            } else {
+                uring_service(client);
+            }
+            return;
+        }
+    } else {
+        --client->chain_left;
+        if (op == URING_READ) {
+            size_t want = client->out_head->length < URING_STAGE_SIZE ? 
+                client->out_head->length : URING_STAGE_SIZE;
+            if (res < 0 || (size_t) res != want) client->chain_failed = 1;
+        } else if (res > 0 && !client->chain_failed) {
+            if (op == URING_SEND_STAGED) client->out_head->offset += res;
+            retire_sent(client, res);
+        } else if (res < 0) {
+            client->chain_failed = 1;
+        }
+
+        if (client->chain_left || client->dropping) {
+            if (client->dropping && !client->chain_left && 
+                !client->recv_armed) drop_client(client);
+            return;
+        }
+        if (client->chain_failed) drop_client(client);
+        else uring_service(client);
+        return;
+    }
+
+    /* A dropped client is freed once its last operation has completed. */
+    if (!client->recv_armed && !client->chain_left) drop_client(client);
+}
+
+/*
+Runs the worker's event loop on io_uring. Returns -1 straight away if the 
+kernel doesn't support what's needed, so the caller can use epoll instead.
+*/
+int uring_loop(SOCKET server) {
+    if (uring_init()) return -1;
+    if (uring_setup_buffers()) {
+        uring_close();
+        return -1;
+    }
+
+    uring_arm_accept(server);
+    if (cache.inotify_fd >= 0) uring_arm_poll(cache.inotify_fd, 
+        URING_CACHE, 1);
+    uring_arm_poll(stop_fd, URING_STOP, 0);
+
+    while (running) {
+        /* Sleep no longer than until the nearest deadline. */
+        if (uring_submit(1, wheel_timeout()) < 0 && errno != ETIME) {
+            fprintf(stderr, "ERROR: io_uring_enter() failed. (%d)\n", errno);
+            break;
+        }
+        loop_ms = now_ms();
+        int batch = 0;
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & ring.cq_mask];
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            /* Free the slot before handling, which may submit more. */
+            __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+
+            int op = data & 7;
+            struct client_info* client = 
+                (struct client_info*) (uintptr_t) (data & ~(uint64_t) 7);
+
+            if (client) {
+                uring_complete(client, op, res, flags);
+            } else if (op == URING_ACCEPT) {
+                if (res >= 0) {
+                    ++batch;
+                    uring_accepted(res);
+                } else {
+                    fprintf(stderr, "ERROR: Issue with accept(). (%d)\n", 
+                        -res);
+                }
+                if (!(flags & IORING_CQE_F_MORE)) uring_arm_accept(server);
+            } else if (op == URING_CACHE) {
+                cache_handle_events();
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    uring_arm_poll(cache.inotify_fd, URING_CACHE, 1);
+                }
+            }
+            /* URING_STOP: running is already 0. */
+
+            tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        }
+        if (batch) hist_record(&self->stats.accept_batch, batch);
+
+        wheel_advance(client_timed_out);
+    }
+
+    uring_close();
+    return 0;
+}
+
+void* worker_main(void* arg) {
+    self = (struct worker*) arg;
+
+    if (pin_workers) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(self->id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    pool_init(max_clients);
+    cache_init(cache_bytes);
+    wheel_init();
+    if (max_per_ip || ip_rate) ip_table_init(max_clients);
+
+    /* Create listening socket at port 8080 */
+    SOCKET server = create_socket(0, "8080");
+
+    if (!use_io_uring || uring_loop(server)) {
+        if (use_io_uring) {
+            fprintf(stderr, "io_uring is unavailable, using epoll.\n");
+        }
+        epoll_loop(server);
+    }
+
+    CLOSESOCKET(server);
+    return 0;
+}
+
+void print_stats() {
+    int i;
+    for (i = 0; i < worker_count; ++i) {
+        struct worker_stats* s = &workers[i].stats;
+        printf("Worker %d: %lu accepted, %lu rejected, %lu over per-IP limits, "
+            "%lu requests, %lu bytes sent, pool high-water mark %d of %d.\n", 
+            i, s->accepts, s->rejected, s->limited, s->requests, 
+            s->bytes_sent, s->pool_high_water, max_clients);
+    }
+
+    static struct worker_stats total;
+    merge_stats(&total);
+    printf("Total: %lu accepted, %lu rejected, %lu over per-IP limits, "
+        "%lu requests, %lu bytes sent, %d clients at peak.\n", 
+        total.accepts, total.rejected, total.limited, total.requests, 
+        total.bytes_sent, total.pool_high_water);
+    if (total.accept_batch.count) {
+        printf("Accepted %.1f connections per wakeup on average, "
+            "%llu at most.\n", (double) total.accept_batch.sum / 
+            total.accept_batch.count, 
+            (unsigned long long) total.accept_batch.max);
+    }
+    if (total.log_dropped) {
+        printf("Access log fell behind; %lu records dropped.\n", 
+            total.log_dropped);
+    }
+}
+
+/*
+client_bench builds this file with WEB_SERVER_NO_MAIN defined, to drive the 
+client table directly, so it supplies its own main().
+*/
+#ifndef WEB_SERVER_NO_MAIN
+int main(int argc, char* argv[]) {
+#if defined(_WIN32)
+    WSADATA d;
+    i (WSAStartup(MAKEWORD(2, 2), &d)) {
+        fprintf(stderr, "ERROR: Issue with Windows initialization.\n");
+        return1;
+    }
+#endif
+
+    /*
+    Writing to a connection the client has closed raises SIGPIPE, which 
+    kills the process by default. send() can be told not to with 
+    MSG_NOSIGNAL, but the file bodies go out with sendfile() and splice(), 
+    which can't, so a client hanging up partway through a file would take 
+    the whole server down with it. The signal is ignored before anything 
+    else happens, and such a write simply fails with EPIPE, dropping just 
+    that client.
+    */
+    signal(SIGPIPE, SIG_IGN);
+
+    /*
+    --max-clients sets the size of each worker's client pool, which is the 
+    most connections a worker will hold open at once. --cache-bytes is 
+    likewise the budget of each worker's file cache.
+    */
+    int a;
+    const char* pack_path = 0;
+    for (a = 1; a < argc; ++a) {
+        if (strcmp(argv[a], "--max-clients") == 0 && a + 1 < argc) {
+            max_clients = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--cache-bytes") == 0 && a + 1 < argc) {
+            cache_bytes = strtoul(argv[++a], 0, 10);
+        } else if (strcmp(argv[a], "--idle-timeout") == 0 && a + 1 < argc) {
+            idle_timeout = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--header-timeout") == 0 && 
+                a + 1 < argc) {
+            header_timeout = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--write-timeout") == 0 && 
+                a + 1 < argc) {
+            write_timeout = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--max-requests") == 0 && a + 1 < argc) {
+            max_requests = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--max-queued") == 0 && a + 1 < argc) {
+            max_queued = strtoul(argv[++a], 0, 10);
+        } else if (strcmp(argv[a], "--workers") == 0 && a + 1 < argc) {
+            worker_count = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--max-per-ip") == 0 && a + 1 < argc) {
+            max_per_ip = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--rate") == 0 && a + 1 < argc) {
+            ip_rate = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--burst") == 0 && a + 1 < argc) {
+            ip_burst = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--access-log") == 0 && a + 1 < argc) {
+            access_log_path = argv[++a];
+        } else if (strcmp(argv[a], "--log-format") == 0 && a + 1 < argc) {
+            ++a;
+            if (strcmp(argv[a], "json") == 0) log_format = LOG_JSON;
+            else log_format = LOG_COMBINED;
+        } else if (strcmp(argv[a], "--verbose") == 0) {
+            verbose = 1;
+        } else if (strcmp(argv[a], "--max-header-bytes") == 0 && 
+                a + 1 < argc) {
+            max_header_bytes = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--backlog") == 0 && a + 1 < argc) {
+            listen_backlog = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--defer-accept") == 0 && a + 1 < argc) {
+            defer_accept = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--fastopen") == 0 && a + 1 < argc) {
+            fastopen_queue = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--pack") == 0 && a + 1 < argc) {
+            pack_path = argv[++a];
+        } else if (strcmp(argv[a], "--compress-level") == 0 && 
+                a + 1 < argc) {
+            compress_level = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--compress-max") == 0 && a + 1 < argc) {
+            compress_max = strtoul(argv[++a], 0, 10);
+        } else if (strcmp(argv[a], "--open-files") == 0 && a + 1 < argc) {
+            open_file_limit = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--pin") == 0) {
+            pin_workers = 1;
+        } else if (strcmp(argv[a], "--io-uring") == 0) {
+            use_io_uring = 1;
+        } else {
+            fprintf(stderr, "Usage: ./web_server [--max-clients N] "
+                "[--cache-bytes N] [--idle-timeout SECONDS] "
+                "[--header-timeout SECONDS] [--write-timeout SECONDS] "
+                "[--max-requests N] [--max-queued BYTES] [--max-per-ip N] "
+                "[--rate REQUESTS_PER_SECOND] [--burst N] [--workers N] "
+                "[--max-header-bytes N] [--open-files N] [--backlog N] "
+                "[--compress-level 0-9] [--compress-max BYTES] [--pack FILE] "
+                "[--defer-accept SECONDS] "
+                "[--fastopen N] [--pin] [--io-uring] "
+                "[--access-log PATH|-|off] "
+                "[--log-format combined|json] [--verbose]\n");
+            return 1;
+        }
+    }
+    if (max_clients < 1) {
+        fprintf(stderr, "ERROR: --max-clients must be at least 1.\n");
+        return 1;
+    }
+    /* By default a client may use up to two seconds' worth of requests at 
+    once. */
+    if (ip_rate && ip_burst < 1) ip_burst = ip_rate * 2;
+
+    if (worker_count < 1) {
+        fprintf(stderr, "ERROR: --workers must be at least 1.\n");
+        return 1;
+    }
+    /* The largest request buffer class is 64 KiB. */
+    if (max_header_bytes < 1 || max_header_bytes > 65536) {
+        fprintf(stderr, "ERROR: --max-header-bytes must be between 1 and "
+            "65536.\n");
+        return 1;
+    }
+    if (compress_level < 0 || compress_level > 9) {
+        fprintf(stderr, "ERROR: --compress-level must be between 0 and 9.\n");
+        return 1;
+    }
+    if (pack_path) pack_open(pack_path);
+    routes_init();
+
+    /* Pick the fastest delimiter scanning kernels this CPU supports. */
+    printf("Using %s delimiter scanning.\n", scan_init());
+
+    /*
+    SIGINT and SIGTERM are blocked before any worker starts, and threads 
+    inherit that, so the signals are only ever picked up by sigwait() below 
+    rather than interrupting a worker at some random point. SIGUSR1 is 
+    handled the same way, and prints the statistics.
+    */
+    sigset_t signals;
+    sigemptyset(&signals);
+
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, 0);
+
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (stop_fd < 0) {
+        fprintf(stderr, "ERROR: eventfd() failed. (%d)\n", GETSOCKETERRNO());
+        return 1;
+    }
+
+    workers = (struct worker*) calloc(worker_count, sizeof(struct worker));
+    if (!workers) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        return 1;
+    }
+
+    /*
+    The access log goes to standard output ("-"), to a file that is appended 
+    to, or nowhere ("off").
+    */
+    if (strcmp(access_log_path, "-") == 0) {
+        log_fd = STDOUT_FILENO;
+    } else if (strcmp(access_log_path, "off") != 0) {
+        log_fd = open(access_log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (log_fd < 0) {
+            fprintf(stderr, "ERROR: Can't open %s. (%d)\n", access_log_path, 
+                errno);
+            return 1;
+        }
+    }
+
+    int i;
+    if (log_fd >= 0) {
+        for (i = 0; i < worker_count; ++i) {
+            workers[i].log.data = (char*) malloc(LOG_RING_SIZE);
+            if (!workers[i].log.data) {
+                fprintf(stderr, "ERROR: Out of memory.\n");
+                return 1;
+            }
+        }
+    }
+    /* Anything printed so far must come out before the first log line. */
+    fflush(stdout);
+
+    pthread_t log_thread;
+    if (log_fd >= 0 && pthread_create(&log_thread, 0, log_main, 0)) {
+        fprintf(stderr, "ERROR: pthread_create() failed.\n");
+        return 1;
+    }
+
+    for (i = 0; i < worker_count; ++i) {
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, 0, worker_main, &workers[i])) {
+            fprintf(stderr, "ERROR: pthread_create() failed.\n");
+            return 1;
+        }
+    }
+
+    /* Wait for a signal telling the server to stop. */
+    int sig;
+    while (1) {
+        sigwait(&signals, &sig);
+        if (sig != SIGUSR1) break;
+
+        char text[STATS_TEXT_SIZE];
+        int length = format_stats(text, 0);
+        printf("%.*s", length, text);
+        fflush(stdout);
+    }
+
+    printf("Stopping workers...\n");
+    running = 0;
+    uint64_t one = 1;
+    if (write(stop_fd, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "ERROR: Couldn't wake workers. (%d)\n", errno);
+    }
+
+    for (i = 0; i < worker_count; ++i) {
+        pthread_join(workers[i].thread, 0);
+    }
+
+    /* The log thread writes out whatever is left before it exits. */
+    if (log_fd >= 0) {
+        __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+        pthread_join(log_thread, 0);
+        if (log_fd != STDOUT_FILENO) close(log_fd);
+        for (i = 0; i < worker_count; ++i) free(workers[i].log.data);
+    }
+
+    print_stats();
+
+    printf("Closing socket...\n");
+    close(stop_fd);
+
+# if defined(_WIN32)
+    WSACleanup();
+#endif 
+    printf("Finished.\n");
+    return(0);
+}
+#endif /* WEB_SERVER_NO_MAIN */